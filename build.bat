@@ -3,8 +3,9 @@
 IF NOT EXIST build mkdir build
 pushd build
 
-set compilerFlags=-nologo -Oi -WX -W4 -wd4005 -wd4189 -wd4201 -wd4996 -wd4100 -Z7 -FC -MP6
+set compilerFlags=-nologo -O2 -Oi -WX -W4 -wd4005 -wd4189 -wd4201 -wd4996 -wd4100 -Z7 -FC -MP6
 set linkerFlags =-incremental:no
 cl %compilerFlags% ..\main.c ..\include\glad\glad.c /link %linkerFlags% ..\glfw3dll.lib
+cl %compilerFlags% -arch:AVX2 ..\headless.c /link %linkerFlags%
 
 popd
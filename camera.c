@@ -0,0 +1,144 @@
+const float oneRadian = PI / 180.0f;
+const float fovy = 45.0f;
+
+float yaw = -90.f, pitch = 0.0f;
+//float yaw = -90.f, pitch = -11.0f;
+
+v3 cP, cFront, cRight, cUp, wUp;
+v3 u, v, w;
+
+static void updateCamera() {
+    cFront.x = cosf(pitch * oneRadian) * cosf(yaw * oneRadian);
+    cFront.y = sinf(pitch * oneRadian);
+    cFront.z = cosf(pitch * oneRadian) * sinf(yaw * oneRadian);
+    cFront = normalizeV3(cFront);
+    cRight = normalizeV3(crossV3(cFront, wUp));
+    cUp = normalizeV3(crossV3(cRight, cFront));
+    w = normalizeV3(subtractV3(cP, addV3(cP, cFront)));
+    u = normalizeV3(crossV3(cUp, w));
+    v = crossV3(w, u);
+}
+
+typedef struct {
+    float nx;
+    float ny;
+    float xSkyMap;
+    float ySkyMap;
+    v3 eye;
+    float halfHeight;
+    v4 u;
+    v4 v;
+    v4 w;
+    int integrator;
+    float tolerance;
+    // Progressive rendering, see progressive.c. sampleIndex is -1 when not accumulating.
+    int sampleIndex;
+    int previewScale;
+    float jitterX;
+    float jitterY;
+} ShaderData;
+
+static ShaderData initShaderData(int nx, int ny, int xSkyMap, int ySkyMap) {
+    ShaderData shaderData;
+    cP = newV3(0.0f, 0.0f, 20.0f);
+    wUp = newV3(0.2f, 1.0f, 0.0f);
+    updateCamera();
+    shaderData.nx = (float)nx;
+    shaderData.ny = (float)ny;
+    shaderData.xSkyMap = (float)xSkyMap;
+    shaderData.ySkyMap = (float)ySkyMap;
+    shaderData.eye = cP;
+    shaderData.halfHeight = tanf(fovy * PI / (180.f * 2.0f));
+    shaderData.u = fromV3(u);
+    shaderData.v = fromV3(v);
+    shaderData.w = fromV3(w);
+    shaderData.integrator = INTEGRATOR_VERLET;
+    shaderData.tolerance = DEFAULT_RK45_TOLERANCE;
+    shaderData.sampleIndex = -1;
+    shaderData.previewScale = 1;
+    shaderData.jitterX = 0.0f;
+    shaderData.jitterY = 0.0f;
+    return shaderData;
+}
+
+// True when both render exactly the same view.
+static bool sameView(ShaderData *a, ShaderData *b) {
+    return equalV3(a->eye, b->eye) && a->halfHeight == b->halfHeight &&
+        a->u.x == b->u.x && a->u.y == b->u.y && a->u.z == b->u.z &&
+        a->v.x == b->v.x && a->v.y == b->v.y && a->v.z == b->v.z &&
+        a->w.x == b->w.x && a->w.y == b->w.y && a->w.z == b->w.z &&
+        a->integrator == b->integrator && a->tolerance == b->tolerance;
+}
+
+// What the viewer's simulation thread hands to the render thread every time the camera changes.
+typedef struct {
+    v3 eye;
+    v3 u;
+    v3 v;
+    v3 w;
+    int integrator;
+} CameraState;
+
+static void applyCamera(ShaderData *shaderData, CameraState *camera) {
+    shaderData->eye = camera->eye;
+    shaderData->u = fromV3(camera->u);
+    shaderData->v = fromV3(camera->v);
+    shaderData->w = fromV3(camera->w);
+    shaderData->integrator = camera->integrator;
+}
+
+#define CAMERA_FRESH 4
+
+// Triple buffer, neither side waits for the other. The writer fills states[back] and swaps it with
+// the published slot, the reader swaps its front slot with the published one when that is fresh.
+typedef struct {
+    CameraState states[3];
+    // Index of the published slot, | CAMERA_FRESH until the reader takes it.
+    volatile int published;
+    int back;
+    int front;
+} CameraHandoff;
+
+static void initCameraHandoff(CameraHandoff *handoff, CameraState *camera) {
+    for (int i=0; i<3; i++) {
+        handoff->states[i] = *camera;
+    }
+    handoff->front = 0;
+    handoff->published = 1;
+    handoff->back = 2;
+}
+
+static void publishCamera(CameraHandoff *handoff, CameraState *camera) {
+    handoff->states[handoff->back] = *camera;
+    handoff->back = atomicExchange(&handoff->published, handoff->back | CAMERA_FRESH) & ~CAMERA_FRESH;
+}
+
+static bool cameraPublished(CameraHandoff *handoff) {
+    return atomicFetchAdd(&handoff->published, 0) & CAMERA_FRESH;
+}
+
+// The latest published camera, true when it wasn't taken yet.
+static bool takeCamera(CameraHandoff *handoff, CameraState *camera) {
+    bool fresh = cameraPublished(handoff);
+    if (fresh) {
+        handoff->front = atomicExchange(&handoff->published, handoff->front) & ~CAMERA_FRESH;
+    }
+    *camera = handoff->states[handoff->front];
+    return fresh;
+}
+
+// Primary ray through normalized image coordinates (s, t), same as compute.glsl.
+static void cameraRay(ShaderData *shaderData, float s, float t, v3 *origin, v3 *direction) {
+    v3 su = newV3(shaderData->u.x, shaderData->u.y, shaderData->u.z);
+    v3 sv = newV3(shaderData->v.x, shaderData->v.y, shaderData->v.z);
+    v3 sw = newV3(shaderData->w.x, shaderData->w.y, shaderData->w.z);
+    float halfHeight = shaderData->halfHeight;
+    float halfWidth = halfHeight * shaderData->nx / shaderData->ny;
+    // direction = lowerLeftCorner + s * horizontal + t * vertical - origin
+    v3 lowerLeft = subtractV3(mulV3(-1.0f, addV3(mulV3(halfWidth, su), mulV3(halfHeight, sv))), sw);
+    v3 horizontal = mulV3(2.0f * halfWidth, su);
+    v3 vertical = mulV3(2.0f * halfHeight, sv);
+    *origin = shaderData->eye;
+    // Unit length, the Verlet step is then the same for every pixel and the deflection table.
+    *direction = normalizeV3(addV3(lowerLeft, addV3(mulV3(s, horizontal), mulV3(t, vertical))));
+}
@@ -0,0 +1,117 @@
+// Keyframed camera paths for the batch renderer. A path file holds one keyframe per line,
+//
+//     time  eyeX eyeY eyeZ  yaw pitch  fovy
+//
+// in seconds and degrees, with times increasing. Blank lines and lines starting with # are skipped.
+// The camera goes through the keyframes on a Catmull-Rom spline.
+
+#define MAX_PATH_LINE 512
+
+typedef struct {
+    float time;
+    v3 eye;
+    float yaw;
+    float pitch;
+    float fovy;
+} Keyframe;
+
+typedef struct {
+    Keyframe *keyframes;
+    int numKeyframes;
+} CameraPath;
+
+// Exits on a malformed file, a batch shouldn't run for hours on a typo.
+static CameraPath readCameraPath(const char *path) {
+    MappedFile file;
+    if (!mapFile(path, &file)) {
+        printf("Could not open camera path %s\n", path);
+        exit(-1);
+    }
+    CameraPath cameraPath = {0};
+    int capacity = 0;
+    const char *text = (const char *)file.data;
+    size_t pos = 0;
+    int lineNumber = 0;
+    while (pos < file.size) {
+        char line[MAX_PATH_LINE];
+        size_t len = 0;
+        while (pos < file.size && text[pos] != '\n') {
+            if (len + 1 < MAX_PATH_LINE) {
+                line[len++] = text[pos];
+            }
+            pos++;
+        }
+        pos++;
+        line[len] = '\0';
+        lineNumber++;
+        char *start = line + strspn(line, " \t\r");
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        Keyframe key;
+        if (sscanf(start, "%f %f %f %f %f %f %f", &key.time, &key.eye.x, &key.eye.y, &key.eye.z, &key.yaw, &key.pitch, &key.fovy) != 7 ||
+            (cameraPath.numKeyframes > 0 && key.time <= cameraPath.keyframes[cameraPath.numKeyframes - 1].time)) {
+            printf("%s:%d: expected time eyeX eyeY eyeZ yaw pitch fovy with increasing times\n", path, lineNumber);
+            exit(-1);
+        }
+        if (cameraPath.numKeyframes == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            cameraPath.keyframes = realloc(cameraPath.keyframes, capacity * sizeof(Keyframe));
+        }
+        cameraPath.keyframes[cameraPath.numKeyframes++] = key;
+    }
+    unmapFile(&file);
+    if (cameraPath.numKeyframes == 0) {
+        printf("No keyframes in %s\n", path);
+        exit(-1);
+    }
+    return cameraPath;
+}
+
+static float catmullRom(float p0, float p1, float p2, float p3, float t) {
+    return 0.5f * (2.0f * p1 + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t * t + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t * t * t);
+}
+
+static float cameraPathDuration(CameraPath *path) {
+    return path->keyframes[path->numKeyframes - 1].time - path->keyframes[0].time;
+}
+
+// The camera at time seconds from the first keyframe, clamped to the path.
+static Keyframe cameraAt(CameraPath *path, float time) {
+    Keyframe *keys = path->keyframes;
+    int last = path->numKeyframes - 1;
+    time += keys[0].time;
+    if (time <= keys[0].time || last == 0) {
+        return keys[0];
+    } else if (time >= keys[last].time) {
+        return keys[last];
+    }
+    int i = 0;
+    while (keys[i + 1].time < time) {
+        i++;
+    }
+    Keyframe *k0 = &keys[i > 0 ? i - 1 : 0], *k1 = &keys[i], *k2 = &keys[i + 1], *k3 = &keys[i + 2 <= last ? i + 2 : last];
+    float t = (time - k1->time) / (k2->time - k1->time);
+    Keyframe key;
+    key.time = time;
+    key.eye.x = catmullRom(k0->eye.x, k1->eye.x, k2->eye.x, k3->eye.x, t);
+    key.eye.y = catmullRom(k0->eye.y, k1->eye.y, k2->eye.y, k3->eye.y, t);
+    key.eye.z = catmullRom(k0->eye.z, k1->eye.z, k2->eye.z, k3->eye.z, t);
+    key.yaw = catmullRom(k0->yaw, k1->yaw, k2->yaw, k3->yaw, t);
+    key.pitch = catmullRom(k0->pitch, k1->pitch, k2->pitch, k3->pitch, t);
+    key.fovy = catmullRom(k0->fovy, k1->fovy, k2->fovy, k3->fovy, t);
+    return key;
+}
+
+// Points shaderData at the camera of key, through the globals of camera.c.
+static void applyKeyframe(ShaderData *shaderData, Keyframe *key) {
+    yaw = key->yaw;
+    pitch = key->pitch;
+    cP = key->eye;
+    updateCamera();
+    shaderData->eye = cP;
+    shaderData->u = fromV3(u);
+    shaderData->v = fromV3(v);
+    shaderData->w = fromV3(w);
+    shaderData->halfHeight = tanf(key->fovy * PI / (180.f * 2.0f));
+}
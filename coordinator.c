@@ -0,0 +1,574 @@
+// Renders spread over worker processes. The coordinator cuts the job, the frames of a camera path
+// or a single still, into work units of -band rows (whole frames by default), hands them to the
+// workers as they become free and queues a unit again when its worker dies, answers garbage or
+// doesn't answer within the timeout. The answers are read without blocking as they come in.
+// Workers are headless processes run with -worker serve, started locally or through a launch
+// command such as ssh, and talk over their standard input and output in lines:
+//
+//     render frame firstRow numRows                   coordinator to worker
+//     done frame firstRow numRows meanSteps           worker to coordinator, then the rows
+//
+// The rows follow as numRows * width RGB floats, bottom row first, in the byte order of the worker.
+// The coordinator assembles them and writes the frames as a single process would.
+
+#define MAX_UNIT_ATTEMPTS 3
+// A worker failing this many times in a row isn't started again.
+#define MAX_WORKER_FAILURES 3
+#define MAX_PROTOCOL_LINE 256
+#define MAX_LAUNCHES 64
+// Seconds a worker gets for a unit, rendering and sending it, before it is taken for hung.
+#define DEFAULT_UNIT_TIMEOUT 600.0
+// Seconds the workers get to exit once the job is done.
+#define WORKER_EXIT_GRACE 5.0
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// Returns the worker's end of the protocol, its stdout, and sends everything printed from then on
+// to stderr. Called before anything is loaded, a message about the sky or its cache would otherwise
+// be taken for an answer.
+static FILE *openProtocol() {
+    fflush(stdout);
+    FILE *protocol = fdopen(dup(STDOUT_FILENO), "wb");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return protocol;
+}
+
+// The worker side, renders the units read from stdin until it is closed and answers on protocol.
+static void serveWorkUnits(FILE *protocol, CameraPath *path, float fps, ShaderData *shaderData, SkyMap *sky, DeflectionLut *lut,
+                           v4 *pixels, int maxRows, int numThreads, CpuKernel kernel) {
+    int nx = shaderData->nx;
+    float *row = malloc((size_t)nx * 3 * sizeof(float));
+    char line[MAX_PROTOCOL_LINE];
+    while (fgets(line, sizeof(line), stdin)) {
+        int frame, firstRow, numRows;
+        if (sscanf(line, "render %d %d %d", &frame, &firstRow, &numRows) != 3 || frame < 0 ||
+            firstRow < 0 || numRows <= 0 || numRows > maxRows || firstRow + numRows > (int)shaderData->ny) {
+            printf("Bad work unit %s", line);
+            exit(-1);
+        }
+        if (path->numKeyframes > 0) {
+            Keyframe key = cameraAt(path, frame / fps);
+            applyKeyframe(shaderData, &key);
+        }
+        double meanSteps = renderCpuRows(shaderData, sky, lut, pixels, firstRow, numRows, numThreads, kernel);
+        fprintf(protocol, "done %d %d %d %.3f\n", frame, firstRow, numRows, meanSteps);
+        for (int y=0; y<numRows; y++) {
+            for (int x=0; x<nx; x++) {
+                v4 pixel = pixels[(size_t)y * nx + x];
+                row[3*x+0] = pixel.x;
+                row[3*x+1] = pixel.y;
+                row[3*x+2] = pixel.z;
+            }
+            fwrite(row, 3 * sizeof(float), nx, protocol);
+        }
+        if (fflush(protocol) != 0) {
+            exit(-1);
+        }
+    }
+    free(row);
+    fclose(protocol);
+}
+
+typedef enum {
+    UNIT_PENDING,
+    UNIT_RUNNING,
+    UNIT_DONE
+} UnitState;
+
+typedef struct {
+    int frame;
+    int firstRow;
+    int numRows;
+    int attempts;
+    UnitState state;
+    // The rows received, bottom first, until they are written.
+    v4 *pixels;
+} WorkUnit;
+
+typedef struct {
+    // exec arguments, NULL terminated.
+    char **args;
+    pid_t pid;
+    // Ends of the pipes to the worker's stdin and from its stdout, -1 once it is dropped.
+    int input;
+    int output;
+    // Unit being rendered, -1 when idle, and the monotonic time it has to be answered by.
+    int unit;
+    double deadline;
+    // The answer received so far: the done line, then once it is complete its rows.
+    char line[MAX_PROTOCOL_LINE];
+    int lineLength;
+    double meanSteps;
+    float *rows;
+    size_t rowBytes;
+    int failures;
+    int unitsDone;
+} Worker;
+
+typedef struct {
+    int nx;
+    int ny;
+    CameraPath *path;
+    const char *output;
+    // Set for a still in bands, which goes to disk band by band in order.
+    ImageStream *stream;
+    // Unset for the deflection table, which takes no steps per ray.
+    bool countSteps;
+    double timeout;
+    int nextWritten;
+    WorkUnit *units;
+    int numUnits;
+    int numDone;
+    // No unit before it is pending.
+    int firstPending;
+    int numFrames;
+    // Per frame, index of its first unit or -1 when it is skipped, units left and steps summed over its rows.
+    int *frameUnits;
+    int *unitsLeft;
+    double *frameSteps;
+} RenderJob;
+
+static double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Reads what the non-blocking fd has of the size bytes of data past *received. Returns false when
+// the other end is closed.
+static bool readAvailable(int fd, void *data, size_t size, size_t *received) {
+    unsigned char *bytes = data;
+    while (*received < size) {
+        ssize_t count = read(fd, bytes + *received, size - *received);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else if (count <= 0) {
+            return false;
+        }
+        *received += count;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    while (size > 0) {
+        ssize_t count = write(fd, bytes, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        } else if (count <= 0) {
+            return false;
+        }
+        bytes += count;
+        size -= count;
+    }
+    return true;
+}
+
+static bool startWorker(Worker *worker) {
+    int toWorker[2], fromWorker[2];
+    if (pipe(toWorker) != 0) {
+        return false;
+    }
+    if (pipe(fromWorker) != 0) {
+        close(toWorker[0]);
+        close(toWorker[1]);
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(toWorker[0], STDIN_FILENO);
+        dup2(fromWorker[1], STDOUT_FILENO);
+        close(toWorker[0]);
+        close(toWorker[1]);
+        close(fromWorker[0]);
+        close(fromWorker[1]);
+        execvp(worker->args[0], worker->args);
+        fprintf(stderr, "Could not run %s\n", worker->args[0]);
+        _exit(127);
+    }
+    close(toWorker[0]);
+    close(fromWorker[1]);
+    if (pid < 0) {
+        close(toWorker[1]);
+        close(fromWorker[0]);
+        return false;
+    }
+    // Workers started later mustn't hold these, a worker only sees the end of its input once the
+    // coordinator closes it.
+    fcntl(toWorker[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fromWorker[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fromWorker[0], F_SETFL, O_NONBLOCK);
+    worker->pid = pid;
+    worker->input = toWorker[1];
+    worker->output = fromWorker[0];
+    worker->unit = -1;
+    return true;
+}
+
+static void killWorker(Worker *worker) {
+    kill(worker->pid, SIGKILL);
+    close(worker->input);
+    close(worker->output);
+    waitpid(worker->pid, NULL, 0);
+    worker->input = worker->output = -1;
+}
+
+// Closes the input of the workers left, which makes them exit, and waits for them. A worker that
+// hung, even one started again after a timeout, is killed after the grace period.
+static void stopWorkers(Worker *workers, int numWorkers) {
+    for (int i=0; i<numWorkers; i++) {
+        if (workers[i].input >= 0) {
+            close(workers[i].input);
+        }
+    }
+    double deadline = monotonicSeconds() + WORKER_EXIT_GRACE;
+    for (int i=0; i<numWorkers; i++) {
+        Worker *worker = &workers[i];
+        if (worker->input < 0) {
+            continue;
+        }
+        while (waitpid(worker->pid, NULL, WNOHANG) == 0) {
+            if (monotonicSeconds() >= deadline) {
+                kill(worker->pid, SIGKILL);
+                waitpid(worker->pid, NULL, 0);
+                break;
+            }
+            sleepMilliseconds(10);
+        }
+        close(worker->output);
+        worker->input = worker->output = -1;
+    }
+}
+
+// Puts the worker's unit back in the queue and starts the worker again, unless it keeps failing.
+// Only a worker that has rendered before counts against the unit, one that can't start at all
+// would use up the attempts of the first unit by itself.
+static void failWorker(RenderJob *job, Worker *worker, int index) {
+    killWorker(worker);
+    free(worker->rows);
+    worker->rows = NULL;
+    worker->lineLength = 0;
+    if (worker->unit >= 0) {
+        WorkUnit *unit = &job->units[worker->unit];
+        printf("Worker %d failed on frame %d rows %d to %d\n", index, unit->frame, unit->firstRow, unit->firstRow + unit->numRows - 1);
+        if (worker->unitsDone > 0 && ++unit->attempts == MAX_UNIT_ATTEMPTS) {
+            printf("Giving up after %d attempts\n", MAX_UNIT_ATTEMPTS);
+            exit(-1);
+        }
+        unit->state = UNIT_PENDING;
+        job->firstPending = worker->unit < job->firstPending ? worker->unit : job->firstPending;
+        worker->unit = -1;
+    } else {
+        printf("Worker %d failed\n", index);
+    }
+    if (++worker->failures < MAX_WORKER_FAILURES && !startWorker(worker)) {
+        worker->failures = MAX_WORKER_FAILURES;
+    }
+}
+
+static int nextPendingUnit(RenderJob *job) {
+    while (job->firstPending < job->numUnits && job->units[job->firstPending].state != UNIT_PENDING) {
+        job->firstPending++;
+    }
+    return job->firstPending < job->numUnits ? job->firstPending : -1;
+}
+
+typedef enum {
+    RECEIVE_FAILED,
+    RECEIVE_PARTIAL,
+    RECEIVE_DONE
+} ReceiveResult;
+
+// Reads what has arrived of the answer of worker to its unit. Fails when the worker is gone or out
+// of step.
+static ReceiveResult receiveUnit(RenderJob *job, Worker *worker) {
+    WorkUnit *unit = &job->units[worker->unit];
+    int nx = job->nx;
+    size_t size = (size_t)nx * unit->numRows * 3 * sizeof(float);
+    if (!worker->rows) {
+        // A byte at a time, the rows mustn't be read with the line.
+        for (;;) {
+            size_t received = 0;
+            if (!readAvailable(worker->output, &worker->line[worker->lineLength], 1, &received)) {
+                return RECEIVE_FAILED;
+            } else if (received == 0) {
+                return RECEIVE_PARTIAL;
+            } else if (worker->line[worker->lineLength] == '\n') {
+                break;
+            } else if (++worker->lineLength == MAX_PROTOCOL_LINE - 1) {
+                return RECEIVE_FAILED;
+            }
+        }
+        worker->line[worker->lineLength] = '\0';
+        int frame, firstRow, numRows;
+        if (sscanf(worker->line, "done %d %d %d %lf", &frame, &firstRow, &numRows, &worker->meanSteps) != 4 ||
+            frame != unit->frame || firstRow != unit->firstRow || numRows != unit->numRows) {
+            return RECEIVE_FAILED;
+        }
+        worker->rows = malloc(size);
+        worker->rowBytes = 0;
+    }
+    if (!readAvailable(worker->output, worker->rows, size, &worker->rowBytes)) {
+        return RECEIVE_FAILED;
+    } else if (worker->rowBytes < size) {
+        return RECEIVE_PARTIAL;
+    }
+    unit->pixels = malloc((size_t)nx * unit->numRows * sizeof(v4));
+    for (size_t i=0; i<(size_t)nx * unit->numRows; i++) {
+        float *row = &worker->rows[3*i];
+        unit->pixels[i] = (v4){row[0], row[1], row[2], 1.0f};
+    }
+    free(worker->rows);
+    worker->rows = NULL;
+    worker->lineLength = 0;
+    job->frameSteps[unit->frame] += worker->meanSteps * unit->numRows;
+    return RECEIVE_DONE;
+}
+
+// Writes whatever the units done complete, frames in any order, bands of a still in order.
+static void writeDoneUnit(RenderJob *job, WorkUnit *unit) {
+    if (job->stream) {
+        while (job->nextWritten < job->numUnits && job->units[job->nextWritten].state == UNIT_DONE) {
+            WorkUnit *band = &job->units[job->nextWritten++];
+            writeImageRows(job->stream, band->pixels, band->numRows);
+            free(band->pixels);
+            band->pixels = NULL;
+        }
+        return;
+    }
+    if (--job->unitsLeft[unit->frame] > 0) {
+        return;
+    }
+    int nx = job->nx;
+    v4 *image = malloc((size_t)nx * job->ny * sizeof(v4));
+    for (int i=job->frameUnits[unit->frame]; i<job->numUnits && job->units[i].frame == unit->frame; i++) {
+        WorkUnit *band = &job->units[i];
+        memcpy(image + (size_t)band->firstRow * nx, band->pixels, (size_t)nx * band->numRows * sizeof(v4));
+        free(band->pixels);
+        band->pixels = NULL;
+    }
+    if (job->path->numKeyframes > 0) {
+        char framePath[1024];
+        snprintf(framePath, sizeof(framePath), job->output, unit->frame);
+        writeFrame(framePath, image, nx, job->ny);
+        if (job->countSteps) {
+            printf("Frame %d of %d, %.1f mean integration steps per ray\n", unit->frame + 1, job->numFrames, job->frameSteps[unit->frame] / job->ny);
+        } else {
+            printf("Frame %d of %d\n", unit->frame + 1, job->numFrames);
+        }
+    } else {
+        writeImage(job->output, image, nx, job->ny);
+    }
+    free(image);
+}
+
+// Exec arguments of each worker: this program for the numLocal local ones, sharing the cores unless
+// the thread count is set, then a shell running each launch command followed by the render settings.
+static char ***workerArguments(char *self, char **renderArgs, int numRenderArgs, int numLocal, bool threadsSet, char **launches, int numLaunches) {
+    char ***workerArgs = malloc((numLocal + numLaunches) * sizeof(char **));
+    static char threads[16];
+    int cores = getNumCores();
+    snprintf(threads, sizeof(threads), "%d", numLocal > 0 && cores > numLocal ? cores / numLocal : 1);
+    for (int i=0; i<numLocal; i++) {
+        char **args = malloc((numRenderArgs + 6) * sizeof(char *));
+        int numArgs = 0;
+        args[numArgs++] = self;
+        for (int j=0; j<numRenderArgs; j++) {
+            args[numArgs++] = renderArgs[j];
+        }
+        args[numArgs++] = "-worker";
+        args[numArgs++] = "serve";
+        if (!threadsSet) {
+            args[numArgs++] = "-threads";
+            args[numArgs++] = threads;
+        }
+        args[numArgs] = NULL;
+        workerArgs[i] = args;
+    }
+    for (int i=0; i<numLaunches; i++) {
+        size_t length = strlen(launches[i]) + 32;
+        for (int j=0; j<numRenderArgs; j++) {
+            length += 4 * strlen(renderArgs[j]) + 3;
+        }
+        char *command = malloc(length);
+        char *end = command + sprintf(command, "%s", launches[i]);
+        // Single quoted for the shell, a quote closes, escapes itself and reopens.
+        for (int j=0; j<numRenderArgs; j++) {
+            *end++ = ' ';
+            *end++ = '\'';
+            for (const char *c=renderArgs[j]; *c; c++) {
+                if (*c == '\'') {
+                    end += sprintf(end, "'\\''");
+                } else {
+                    *end++ = *c;
+                }
+            }
+            *end++ = '\'';
+        }
+        sprintf(end, " -worker serve");
+        char **args = malloc(4 * sizeof(char *));
+        args[0] = "/bin/sh";
+        args[1] = "-c";
+        args[2] = command;
+        args[3] = NULL;
+        workerArgs[numLocal + i] = args;
+    }
+    return workerArgs;
+}
+
+// Renders the frames of path, or the still when it has no keyframes, on workers running
+// workerArgs, each one a NULL terminated exec argument list. output is the file name or pattern,
+// stream the opened file of a still in bands, countSteps unset for kernels that report no steps and
+// timeout the seconds a worker gets for a unit. Frames of a path already on disk are skipped.
+static void coordinateRender(CameraPath *path, float fps, int nx, int ny, int bandRows, const char *output, ImageStream *stream, bool countSteps,
+                             double timeout, char ***workerArgs, int numWorkers) {
+    RenderJob job = {0};
+    job.nx = nx;
+    job.ny = ny;
+    job.path = path;
+    job.output = output;
+    job.stream = stream;
+    job.countSteps = countSteps;
+    job.timeout = timeout;
+    job.numFrames = path->numKeyframes > 0 ? (int)(cameraPathDuration(path) * fps) + 1 : 1;
+    int rows = bandRows > 0 && bandRows < ny ? bandRows : ny;
+    int unitsPerFrame = (ny + rows - 1) / rows;
+    job.units = malloc((size_t)job.numFrames * unitsPerFrame * sizeof(WorkUnit));
+    job.frameUnits = malloc(job.numFrames * sizeof(int));
+    job.unitsLeft = malloc(job.numFrames * sizeof(int));
+    job.frameSteps = calloc(job.numFrames, sizeof(double));
+    for (int frame=0; frame<job.numFrames; frame++) {
+        job.frameUnits[frame] = -1;
+        if (path->numKeyframes > 0) {
+            char framePath[1024];
+            snprintf(framePath, sizeof(framePath), output, frame);
+            if (fileExists(framePath)) {
+                continue;
+            }
+        }
+        job.frameUnits[frame] = job.numUnits;
+        job.unitsLeft[frame] = unitsPerFrame;
+        // Top band first, like the single process.
+        for (int lastRow=ny; lastRow>0; lastRow-=rows) {
+            WorkUnit *unit = &job.units[job.numUnits++];
+            unit->frame = frame;
+            unit->firstRow = lastRow > rows ? lastRow - rows : 0;
+            unit->numRows = lastRow - unit->firstRow;
+            unit->attempts = 0;
+            unit->state = UNIT_PENDING;
+            unit->pixels = NULL;
+        }
+    }
+
+    // A worker dying mid write mustn't take the coordinator with it.
+    signal(SIGPIPE, SIG_IGN);
+    Worker *workers = calloc(numWorkers, sizeof(Worker));
+    struct pollfd *fds = malloc(numWorkers * sizeof(struct pollfd));
+    int *polled = malloc(numWorkers * sizeof(int));
+    for (int i=0; i<numWorkers; i++) {
+        workers[i].args = workerArgs[i];
+        if (!startWorker(&workers[i])) {
+            printf("Could not start worker %d\n", i);
+            exit(-1);
+        }
+    }
+    while (job.numDone < job.numUnits) {
+        int numPolled = 0, numAlive = 0;
+        double nextDeadline = 0.0;
+        for (int i=0; i<numWorkers; i++) {
+            Worker *worker = &workers[i];
+            if (worker->input >= 0 && worker->unit < 0 && nextPendingUnit(&job) >= 0) {
+                WorkUnit *unit = &job.units[job.firstPending];
+                char line[MAX_PROTOCOL_LINE];
+                int length = snprintf(line, sizeof(line), "render %d %d %d\n", unit->frame, unit->firstRow, unit->numRows);
+                worker->unit = job.firstPending;
+                worker->deadline = monotonicSeconds() + job.timeout;
+                unit->state = UNIT_RUNNING;
+                if (!writeFully(worker->input, line, length)) {
+                    failWorker(&job, worker, i);
+                }
+            }
+            numAlive += worker->input >= 0;
+            if (worker->input >= 0 && worker->unit >= 0) {
+                fds[numPolled].fd = worker->output;
+                fds[numPolled].events = POLLIN;
+                polled[numPolled++] = i;
+                nextDeadline = numPolled == 1 || worker->deadline < nextDeadline ? worker->deadline : nextDeadline;
+            }
+        }
+        if (numAlive == 0) {
+            printf("All workers failed, %d of %d work units left\n", job.numUnits - job.numDone, job.numUnits);
+            exit(-1);
+        }
+        if (numPolled == 0) {
+            continue;
+        }
+        // In milliseconds, a minute at most so that long timeouts fit.
+        double wait = ceil((nextDeadline - monotonicSeconds()) * 1000.0);
+        if (poll(fds, numPolled, wait > 0.0 ? (int)fmin(wait, 60000.0) : 0) < 0) {
+            continue;
+        }
+        double now = monotonicSeconds();
+        for (int i=0; i<numPolled; i++) {
+            Worker *worker = &workers[polled[i]];
+            ReceiveResult result = fds[i].revents ? receiveUnit(&job, worker) : RECEIVE_PARTIAL;
+            if (result == RECEIVE_PARTIAL && now >= worker->deadline) {
+                printf("Worker %d timed out after %.0f seconds\n", polled[i], job.timeout);
+                result = RECEIVE_FAILED;
+            }
+            if (result == RECEIVE_FAILED) {
+                failWorker(&job, worker, polled[i]);
+                continue;
+            } else if (result == RECEIVE_PARTIAL) {
+                continue;
+            }
+            WorkUnit *unit = &job.units[worker->unit];
+            unit->state = UNIT_DONE;
+            job.numDone++;
+            worker->unit = -1;
+            worker->failures = 0;
+            worker->unitsDone++;
+            writeDoneUnit(&job, unit);
+        }
+    }
+    stopWorkers(workers, numWorkers);
+    if (path->numKeyframes == 0 && countSteps) {
+        printf("Mean integration steps per ray: %.1f\n", job.frameSteps[0] / ny);
+    }
+    free(workers);
+    free(fds);
+    free(polled);
+    free(job.units);
+    free(job.frameUnits);
+    free(job.unitsLeft);
+    free(job.frameSteps);
+}
+#else
+static FILE *openProtocol() {
+    return NULL;
+}
+
+static char ***workerArguments(char *self, char **renderArgs, int numRenderArgs, int numLocal, bool threadsSet, char **launches, int numLaunches) {
+    return NULL;
+}
+
+static void serveWorkUnits(FILE *protocol, CameraPath *path, float fps, ShaderData *shaderData, SkyMap *sky, DeflectionLut *lut,
+                           v4 *pixels, int maxRows, int numThreads, CpuKernel kernel) {
+    printf("Workers aren't supported on Windows\n");
+    exit(-1);
+}
+
+static void coordinateRender(CameraPath *path, float fps, int nx, int ny, int bandRows, const char *output, ImageStream *stream, bool countSteps,
+                             double timeout, char ***workerArgs, int numWorkers) {
+    printf("Workers aren't supported on Windows\n");
+    exit(-1);
+}
+#endif
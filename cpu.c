@@ -0,0 +1,135 @@
+// Tiled CPU renderer, runs the geodesic kernel over the frame, or a band of its rows, on all cores.
+
+#define TILE_SIZE 32
+
+typedef enum {
+    KERNEL_SCALAR,
+    KERNEL_PACKET,
+    KERNEL_LUT
+} CpuKernel;
+
+typedef struct {
+    ShaderData *shaderData;
+    SkyMap *sky;
+    DeflectionLut *lut;
+    v4 *pixels;
+    int nx;
+    // Rows of the band rendered, pixels holds them from firstRow on.
+    int firstRow;
+    int numRows;
+    int numTilesX;
+    int numTiles;
+    CpuKernel kernel;
+    // Integration steps taken in every tile.
+    int *tileSteps;
+    volatile int nextTile;
+} CpuRender;
+
+#ifdef SIMD_ENABLED
+static void renderTilePackets(CpuRender *render, int x0, int y0, int x1, int y1, int *numSteps) {
+    float dirX[SIMD_LANES], dirY[SIMD_LANES], dirZ[SIMD_LANES];
+    v4 colors[SIMD_LANES];
+    v3 origin = render->shaderData->eye;
+    for (int y=y0; y<y1; y++) {
+        for (int x=x0; x<x1; x+=SIMD_LANES) {
+            int count = x1 - x < SIMD_LANES ? x1 - x : SIMD_LANES;
+            for (int lane=0; lane<SIMD_LANES; lane++) {
+                v3 direction = newV3(0.0f, 0.0f, 0.0f);
+                if (lane < count) {
+                    float s = (float)(x + lane) / render->shaderData->nx;
+                    float t = (float)y / render->shaderData->ny;
+                    cameraRay(render->shaderData, s, t, &origin, &direction);
+                }
+                dirX[lane] = direction.x;
+                dirY[lane] = direction.y;
+                dirZ[lane] = direction.z;
+            }
+            tracePacket(render->sky, origin, dirX, dirY, dirZ, count, colors, numSteps);
+            for (int lane=0; lane<count; lane++) {
+                render->pixels[(size_t)(y - render->firstRow) * render->nx + x + lane] = colors[lane];
+            }
+        }
+    }
+}
+#endif
+
+static void renderTile(CpuRender *render, int tile) {
+    int x0 = (tile % render->numTilesX) * TILE_SIZE;
+    int y0 = render->firstRow + (tile / render->numTilesX) * TILE_SIZE;
+    int lastRow = render->firstRow + render->numRows;
+    int x1 = x0 + TILE_SIZE < render->nx ? x0 + TILE_SIZE : render->nx;
+    int y1 = y0 + TILE_SIZE < lastRow ? y0 + TILE_SIZE : lastRow;
+    int *numSteps = &render->tileSteps[tile];
+    *numSteps = 0;
+    int integrator = render->shaderData->integrator;
+#ifdef SIMD_ENABLED
+    if (render->kernel == KERNEL_PACKET && integrator == INTEGRATOR_VERLET) {
+        renderTilePackets(render, x0, y0, x1, y1, numSteps);
+        return;
+    }
+#endif
+    for (int y=y0; y<y1; y++) {
+        for (int x=x0; x<x1; x++) {
+            v3 origin, direction;
+            float s = (float)x / render->shaderData->nx;
+            float t = (float)y / render->shaderData->ny;
+            cameraRay(render->shaderData, s, t, &origin, &direction);
+            v4 *pixel = &render->pixels[(size_t)(y - render->firstRow) * render->nx + x];
+            if (render->kernel == KERNEL_LUT && traceLut(render->lut, render->sky, origin, direction, pixel)) {
+                continue;
+            }
+            if (integrator == INTEGRATOR_BINET) {
+                *pixel = traceBinet(render->sky, origin, direction, numSteps);
+            } else if (integrator == INTEGRATOR_RK45) {
+                *pixel = traceRk45(render->sky, origin, direction, render->shaderData->tolerance, numSteps);
+            } else {
+                *pixel = traceRay(render->sky, origin, direction, numSteps);
+            }
+        }
+    }
+}
+
+static void renderWorker(void *arg) {
+    CpuRender *render = (CpuRender *)arg;
+    for (;;) {
+        int tile = atomicFetchAdd(&render->nextTile, 1);
+        if (tile >= render->numTiles) {
+            break;
+        }
+        renderTile(render, tile);
+    }
+}
+
+// Renders rows firstRow to firstRow + numRows of the shaderData->nx by shaderData->ny image, row 0
+// being the bottom of the image like the GPU output, with shaderData->integrator. Returns the mean
+// number of integration steps per ray.
+// KERNEL_PACKET only exists for the Verlet integrator and falls back to the scalar kernel
+// otherwise or when the build has no SIMD kernel. KERNEL_LUT falls back to the scalar kernel
+// for cameras outside of the radii covered by lut.
+static double renderCpuRows(ShaderData *shaderData, SkyMap *sky, DeflectionLut *lut, v4 *pixels, int firstRow, int numRows, int numThreads, CpuKernel kernel) {
+    CpuRender render;
+    render.shaderData = shaderData;
+    render.sky = sky;
+    render.lut = lut;
+    render.pixels = pixels;
+    render.nx = (int)shaderData->nx;
+    render.firstRow = firstRow;
+    render.numRows = numRows;
+    render.numTilesX = (render.nx + TILE_SIZE - 1) / TILE_SIZE;
+    render.numTiles = render.numTilesX * ((numRows + TILE_SIZE - 1) / TILE_SIZE);
+    render.kernel = kernel;
+    render.tileSteps = malloc(render.numTiles * sizeof(int));
+    render.nextTile = 0;
+    runThreads(numThreads, renderWorker, &render);
+
+    double totalSteps = 0.0;
+    for (int i=0; i<render.numTiles; i++) {
+        totalSteps += render.tileSteps[i];
+    }
+    free(render.tileSteps);
+    return totalSteps / ((double)render.nx * numRows);
+}
+
+static double renderCpu(ShaderData *shaderData, SkyMap *sky, DeflectionLut *lut, v4 *pixels, int numThreads, CpuKernel kernel) {
+    return renderCpuRows(shaderData, sky, lut, pixels, 0, (int)shaderData->ny, numThreads, kernel);
+}
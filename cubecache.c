@@ -0,0 +1,66 @@
+// Direction-space cache for pure camera rotation. From a fixed eye the geodesics of a rotated view
+// are the same, only permuted, so the results (exit direction and disc alpha) are traced once into
+// a cube map indexed by the initial ray direction, and views are resampled from it until the eye
+// or the integrator change.
+
+#define CUBE_CACHE_UNIT 2
+
+typedef struct {
+    int size;
+    GLuint textureId;
+    bool valid;
+    v3 eye;
+    int integrator;
+    float tolerance;
+} CubeCache;
+
+// size is the resolution of a face, 0 disables the cache.
+static CubeCache initCubeCache(int size) {
+    CubeCache cache = {0};
+    cache.size = size;
+    if (size <= 0) {
+        return cache;
+    }
+    glGenTextures(1, &cache.textureId);
+    glActiveTexture(GL_TEXTURE0 + CUBE_CACHE_UNIT);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, cache.textureId);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexStorage2D(GL_TEXTURE_CUBE_MAP, 1, GL_RGBA32F, size, size);
+    glBindImageTexture(CUBE_CACHE_UNIT, cache.textureId, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    return cache;
+}
+
+static GLuint cubeCacheProgram(int integrator) {
+    char *path = "shaders/cubemap.glsl";
+    return kernelProgram("cubeCache", &path, 1, integrator);
+}
+
+static GLuint cubeResampleProgram(int integrator) {
+    char *path = "shaders/resample.glsl";
+    return kernelProgram("cubeResample", &path, 1, integrator);
+}
+
+static bool cubeCacheMatches(CubeCache *cache, ShaderData *shaderData) {
+    return cache->valid && equalV3(cache->eye, shaderData->eye) &&
+        cache->integrator == shaderData->integrator && cache->tolerance == shaderData->tolerance;
+}
+
+// Renders the nx by ny results image from the cache, tracing it first if it is stale.
+// The ShaderData SSBO must be up to date.
+static void renderFromCubeCache(CubeCache *cache, ShaderData *shaderData, int nx, int ny) {
+    if (!cubeCacheMatches(cache, shaderData)) {
+        glUseProgram(cubeCacheProgram(shaderData->integrator));
+        glDispatchCompute((cache->size + 31) / 32, (cache->size + 31) / 32, 6);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        cache->valid = true;
+        cache->eye = shaderData->eye;
+        cache->integrator = shaderData->integrator;
+        cache->tolerance = shaderData->tolerance;
+    }
+    glUseProgram(cubeResampleProgram(shaderData->integrator));
+    glDispatchCompute((nx + 31) / 32, (ny + 31) / 32, 1);
+}
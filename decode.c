@@ -0,0 +1,303 @@
+// Parallel image decoding. stb_image decodes an image on one thread, but a baseline JPEG whose
+// restart interval is a whole number of MCU rows can be cut at its restart markers into strips
+// that decode independently: each strip is the headers with the image height patched, followed by
+// its part of the scan. Such files are written by e.g. `jpegtran -restart 1 in.jpg > out.jpg`.
+// Anything else is decoded by stb_image in one piece.
+
+// Strips per thread, so that threads finishing early pick up more.
+#define STRIPS_PER_THREAD 4
+
+static int readBigEndian16(unsigned char *bytes) {
+    return bytes[0] << 8 | bytes[1];
+}
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int width;
+    int height;
+    size_t sofOffset;
+    // Pixel rows per restart interval.
+    int intervalRows;
+    // Where the scan of each restart interval starts and ends, markers excluded.
+    size_t *intervalStarts;
+    size_t *intervalEnds;
+    int numIntervals;
+    int intervalsPerStrip;
+    int numStrips;
+    // Strips left to decode, up to endStrip.
+    volatile int nextStrip;
+    int endStrip;
+    volatile int failed;
+    // RGBA8 rows from firstRow, or the whole image bottom row first when flipped.
+    unsigned char *pixels;
+    int firstRow;
+    bool flipped;
+} StripDecode;
+
+// Finds the restart intervals of a baseline JPEG, returns false if it can't be cut into strips.
+static bool findJpegStrips(StripDecode *decode) {
+    unsigned char *data = decode->data;
+    size_t size = decode->size;
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return false;
+    }
+    int numComponents = 0, mcuWidth = 0, mcuHeight = 0, restartInterval = 0;
+    size_t scanStart = 0;
+    for (size_t i=2; i + 4 <= size && !scanStart; ) {
+        if (data[i] != 0xFF) {
+            return false;
+        }
+        int marker = data[i + 1];
+        if (marker == 0xFF) {
+            i++;
+            continue;
+        }
+        size_t length = readBigEndian16(data + i + 2);
+        if (i + 2 + length > size) {
+            return false;
+        }
+        unsigned char *segment = data + i + 4;
+        if (marker == 0xC0 || marker == 0xC1) {
+            decode->sofOffset = i;
+            decode->height = readBigEndian16(segment + 1);
+            decode->width = readBigEndian16(segment + 3);
+            numComponents = segment[5];
+            int maxH = 1, maxV = 1;
+            for (int c=0; c<numComponents; c++) {
+                int sampling = segment[6 + 3 * c + 1];
+                maxH = (sampling >> 4) > maxH ? sampling >> 4 : maxH;
+                maxV = (sampling & 15) > maxV ? sampling & 15 : maxV;
+            }
+            // A single component is not interleaved, its MCU is one block.
+            mcuWidth = numComponents == 1 ? 8 : 8 * maxH;
+            mcuHeight = numComponents == 1 ? 8 : 8 * maxV;
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            // Progressive, lossless or arithmetic coded.
+            return false;
+        } else if (marker == 0xDD) {
+            restartInterval = readBigEndian16(segment);
+        } else if (marker == 0xDA) {
+            // Only a single scan of all the components can be cut.
+            if (segment[0] != numComponents) {
+                return false;
+            }
+            scanStart = i + 2 + length;
+        }
+        i += 2 + length;
+    }
+    if (!scanStart || !mcuWidth || decode->height == 0 || restartInterval == 0) {
+        return false;
+    }
+    int mcusPerRow = (decode->width + mcuWidth - 1) / mcuWidth;
+    int mcuRows = (decode->height + mcuHeight - 1) / mcuHeight;
+    if (restartInterval % mcusPerRow != 0) {
+        return false;
+    }
+    int rowsPerInterval = restartInterval / mcusPerRow;
+    decode->intervalRows = rowsPerInterval * mcuHeight;
+    int numIntervals = (mcuRows + rowsPerInterval - 1) / rowsPerInterval;
+
+    decode->intervalStarts = malloc(numIntervals * sizeof(size_t));
+    decode->intervalEnds = malloc(numIntervals * sizeof(size_t));
+    decode->intervalStarts[0] = scanStart;
+    int interval = 0;
+    for (size_t i=scanStart; i + 1 < size; ) {
+        unsigned char *next = memchr(data + i, 0xFF, size - 1 - i);
+        if (!next) {
+            break;
+        }
+        i = next - data;
+        int marker = data[i + 1];
+        if (marker == 0x00 || marker == 0xFF) {
+            // Stuffed byte or fill.
+            i += marker == 0x00 ? 2 : 1;
+        } else if (marker >= 0xD0 && marker <= 0xD7 && interval + 1 < numIntervals) {
+            decode->intervalEnds[interval++] = i;
+            decode->intervalStarts[interval] = i + 2;
+            i += 2;
+        } else if (marker == 0xD9) {
+            decode->intervalEnds[interval++] = i;
+            break;
+        } else {
+            break;
+        }
+    }
+    if (interval != numIntervals) {
+        free(decode->intervalStarts);
+        free(decode->intervalEnds);
+        return false;
+    }
+    decode->numIntervals = numIntervals;
+    return true;
+}
+
+static void decodeStripWorker(void *arg) {
+    StripDecode *decode = (StripDecode *)arg;
+    size_t headerSize = decode->intervalStarts[0];
+    for (;;) {
+        int strip = atomicFetchAdd(&decode->nextStrip, 1);
+        if (strip >= decode->endStrip) {
+            return;
+        }
+        int first = strip * decode->intervalsPerStrip;
+        int last = first + decode->intervalsPerStrip < decode->numIntervals ? first + decode->intervalsPerStrip : decode->numIntervals;
+        int y0 = first * decode->intervalRows;
+        int y1 = last * decode->intervalRows < decode->height ? last * decode->intervalRows : decode->height;
+
+        // The headers with the height of the strip, its scan, which keeps the restart markers
+        // between its intervals, and an EOI.
+        size_t scanSize = decode->intervalEnds[last - 1] - decode->intervalStarts[first];
+        unsigned char *jpeg = malloc(headerSize + scanSize + 2);
+        memcpy(jpeg, decode->data, headerSize);
+        jpeg[decode->sofOffset + 5] = (unsigned char)((y1 - y0) >> 8);
+        jpeg[decode->sofOffset + 6] = (unsigned char)(y1 - y0);
+        memcpy(jpeg + headerSize, decode->data + decode->intervalStarts[first], scanSize);
+        jpeg[headerSize + scanSize] = 0xFF;
+        jpeg[headerSize + scanSize + 1] = 0xD9;
+
+        int width, height, numChannels;
+        unsigned char *rows = stbi_load_from_memory(jpeg, (int)(headerSize + scanSize + 2), &width, &height, &numChannels, STBI_rgb_alpha);
+        free(jpeg);
+        if (!rows || width != decode->width || height != y1 - y0) {
+            decode->failed = 1;
+            stbi_image_free(rows);
+            continue;
+        }
+        size_t rowSize = (size_t)width * 4;
+        for (int y=y0; y<y1; y++) {
+            int row = decode->flipped ? decode->height - 1 - y : y - decode->firstRow;
+            memcpy(decode->pixels + (size_t)row * rowSize, rows + (size_t)(y - y0) * rowSize, rowSize);
+        }
+        stbi_image_free(rows);
+    }
+}
+
+// Decodes the image at path to RGBA8, bottom row first like stbi_load with
+// stbi_set_flip_vertically_on_load(true), on up to numThreads threads. Returns NULL if it
+// can't be read, the pixels are freed with free().
+static unsigned char *decodeImage(const char *path, int *width, int *height, int numThreads) {
+    MappedFile file;
+    if (!mapFile(path, &file)) {
+        return NULL;
+    }
+    StripDecode decode = {0};
+    decode.data = file.data;
+    decode.size = file.size;
+    unsigned char *pixels = NULL;
+    if (numThreads > 1 && findJpegStrips(&decode)) {
+        decode.intervalsPerStrip = (decode.numIntervals + STRIPS_PER_THREAD * numThreads - 1) / (STRIPS_PER_THREAD * numThreads);
+        decode.numStrips = (decode.numIntervals + decode.intervalsPerStrip - 1) / decode.intervalsPerStrip;
+        decode.endStrip = decode.numStrips;
+        decode.pixels = malloc((size_t)decode.width * decode.height * 4);
+        // The strips are flipped when copied.
+        decode.flipped = true;
+        stbi_set_flip_vertically_on_load(false);
+        runThreads(numThreads, decodeStripWorker, &decode);
+        free(decode.intervalStarts);
+        free(decode.intervalEnds);
+        if (decode.failed) {
+            free(decode.pixels);
+        } else {
+            pixels = decode.pixels;
+            *width = decode.width;
+            *height = decode.height;
+        }
+    }
+    if (!pixels) {
+        int numChannels;
+        stbi_set_flip_vertically_on_load(true);
+        pixels = stbi_load_from_memory(file.data, (int)file.size, width, height, &numChannels, STBI_rgb_alpha);
+    }
+    unmapFile(&file);
+    return pixels;
+}
+
+// Bytes of the rows decoded at once by nextImageRow.
+#define ROW_BATCH_BYTES (64 << 20)
+
+// Rows of an image from the top, for images too large to be decoded whole. A JPEG that can be cut
+// into strips is decoded a batch of strips at a time, anything else is decoded whole.
+typedef struct {
+    MappedFile file;
+    StripDecode decode;
+    bool strips;
+    int numThreads;
+    int stripsPerBatch;
+    int width;
+    int height;
+    // RGBA8 rows from firstRow to endRow.
+    unsigned char *pixels;
+    int firstRow;
+    int endRow;
+    int nextRow;
+} ImageRows;
+
+// Returns false if the image at path can't be read.
+static bool openImageRows(ImageRows *rows, const char *path, int numThreads) {
+    memset(rows, 0, sizeof(*rows));
+    if (!mapFile(path, &rows->file)) {
+        return false;
+    }
+    StripDecode *decode = &rows->decode;
+    decode->data = rows->file.data;
+    decode->size = rows->file.size;
+    rows->numThreads = numThreads;
+    rows->strips = findJpegStrips(decode);
+    if (rows->strips) {
+        // Strips of a few hundred rows, as many at once as fit in a batch.
+        decode->intervalsPerStrip = 256 / decode->intervalRows > 1 ? 256 / decode->intervalRows : 1;
+        decode->numStrips = (decode->numIntervals + decode->intervalsPerStrip - 1) / decode->intervalsPerStrip;
+        size_t stripBytes = (size_t)decode->width * decode->intervalsPerStrip * decode->intervalRows * 4;
+        rows->stripsPerBatch = ROW_BATCH_BYTES / stripBytes > 1 ? (int)(ROW_BATCH_BYTES / stripBytes) : 1;
+        rows->width = decode->width;
+        rows->height = decode->height;
+        rows->pixels = malloc(stripBytes * rows->stripsPerBatch);
+        stbi_set_flip_vertically_on_load(false);
+    } else {
+        int numChannels;
+        stbi_set_flip_vertically_on_load(false);
+        rows->pixels = stbi_load_from_memory(rows->file.data, (int)rows->file.size, &rows->width, &rows->height, &numChannels, STBI_rgb_alpha);
+        rows->endRow = rows->height;
+        unmapFile(&rows->file);
+        if (!rows->pixels) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The next row of the image, NULL after the last one or if it can't be decoded. The row stays
+// valid until the next call.
+static unsigned char *nextImageRow(ImageRows *rows) {
+    if (rows->nextRow >= rows->height) {
+        return NULL;
+    }
+    if (rows->nextRow >= rows->endRow) {
+        StripDecode *decode = &rows->decode;
+        int rowsPerStrip = decode->intervalsPerStrip * decode->intervalRows;
+        int firstStrip = rows->nextRow / rowsPerStrip;
+        decode->nextStrip = firstStrip;
+        decode->endStrip = firstStrip + rows->stripsPerBatch < decode->numStrips ? firstStrip + rows->stripsPerBatch : decode->numStrips;
+        decode->pixels = rows->pixels;
+        decode->firstRow = firstStrip * rowsPerStrip;
+        int numStrips = decode->endStrip - firstStrip;
+        runThreads(rows->numThreads < numStrips ? rows->numThreads : numStrips, decodeStripWorker, decode);
+        if (decode->failed) {
+            return NULL;
+        }
+        rows->firstRow = decode->firstRow;
+        rows->endRow = decode->endStrip * rowsPerStrip < rows->height ? decode->endStrip * rowsPerStrip : rows->height;
+    }
+    int y = rows->nextRow++;
+    return rows->pixels + (size_t)(y - rows->firstRow) * rows->width * 4;
+}
+
+static void closeImageRows(ImageRows *rows) {
+    if (rows->strips) {
+        free(rows->decode.intervalStarts);
+        free(rows->decode.intervalEnds);
+        unmapFile(&rows->file);
+    }
+    free(rows->pixels);
+}
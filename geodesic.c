@@ -0,0 +1,484 @@
+// Scalar port of the geodesic kernel in shaders/compute.glsl, keep the two in sync.
+
+// The CPU kernels are built with these, they can be overridden with -D. The viewer passes its
+// own values to the shaders, see KernelConstants.
+#ifndef NUM_ITER
+#define NUM_ITER 10000
+#endif
+#ifndef STEP
+#define STEP 0.16f
+#endif
+#ifndef D_INNER_R
+#define D_INNER_R 2.6f
+#endif
+#ifndef D_OUTER_R
+#define D_OUTER_R 14.0f
+#endif
+#ifndef SKY_R
+#define SKY_R 30.0f
+#endif
+
+const float skyR2 = SKY_R * SKY_R;
+const float potentialCoef = -1.5f;
+const float dInnerR2 = D_INNER_R * D_INNER_R;
+const float dOuterR2 = D_OUTER_R * D_OUTER_R;
+
+typedef struct {
+    int width;
+    int height;
+    // RGBA8, flipped vertically on load like the GPU upload.
+    unsigned char *texels;
+} SkyMap;
+
+static v4 skyMapLoad(SkyMap *sky, int x, int y) {
+    // imageLoad returns zero outside of the image.
+    if (x < 0 || x >= sky->width || y < 0 || y >= sky->height) {
+        return newV4(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+    unsigned char *texel = sky->texels + 4 * ((size_t)y * sky->width + x);
+    const float scale = 1.0f / 255.0f;
+    return newV4(scale * texel[0], scale * texel[1], scale * texel[2], scale * texel[3]);
+}
+
+static v4 skyMapLookup(SkyMap *sky, v3 point) {
+    float theta = acosf(point.z / sqrtf(dotV3(point, point)));
+    float phi = atan2f(point.y, point.x);
+    int x = (int)((phi / (2 * PI)) * sky->width);
+    int y = (int)((theta / PI) * sky->height);
+    if (x < 0) { x = x + sky->width; }
+    if (y < 0) { y = y + sky->height; }
+    return skyMapLoad(sky, x, y);
+}
+
+typedef enum {
+    INTEGRATOR_VERLET,
+    INTEGRATOR_BINET,
+    INTEGRATOR_RK45
+} Integrator;
+
+#define DEFAULT_RK45_TOLERANCE 1e-5f
+
+// Constants compiled into the GPU kernels as #defines, so they are still constant folded.
+typedef struct {
+    int numIter;
+    float step;
+    float dInnerR;
+    float dOuterR;
+    float skyR;
+    // The GPU sky map is stored as sRGB.
+    int skySrgb;
+    // The GPU sky is looked up in a mipmapped cube map rather than the equirectangular map.
+    int skyCube;
+    // The GPU sky is paged in by tiles from a virtual texture, see skytiles.c.
+    int skyTiles;
+} KernelConstants;
+
+// Writes the #defines of constants and integrator for the shaders.
+static void kernelDefines(KernelConstants *constants, int integrator, char *defines, int len) {
+    snprintf(defines, len,
+        "#define NUM_ITER %d\n"
+        "#define STEP %#.7g\n"
+        "#define D_INNER_R %#.7g\n"
+        "#define D_OUTER_R %#.7g\n"
+        "#define SKY_R %#.7g\n"
+        "#define SKY_SRGB %d\n"
+        "#define SKY_CUBE %d\n"
+        "#define SKY_TILES %d\n"
+        "#define INTEGRATOR %d\n",
+        constants->numIter, constants->step, constants->dInnerR, constants->dOuterR, constants->skyR,
+        constants->skySrgb, constants->skyCube, constants->skyTiles, integrator);
+}
+
+static void crossAccretion(v4 *color, bool *crossedAccretion, float sqrNorm) {
+    if (!*crossedAccretion) {
+        *color = newV4(1.0f, 1.0f, 0.98f, 0.0f);
+    }
+    *crossedAccretion = true;
+    float x = (D_OUTER_R - sqrtf(sqrNorm)) / (D_OUTER_R - D_INNER_R);
+    color->w += sinf(PI * x * x);
+}
+
+static v4 hitSky(SkyMap *sky, v4 color, bool crossedAccretion, v3 point) {
+    if (crossedAccretion) {
+        return mixV4(skyMapLookup(sky, point), color, color.w);
+    }
+    return skyMapLookup(sky, point);
+}
+
+static v4 hitHorizon(v4 color, bool crossedAccretion) {
+    if (crossedAccretion) {
+        return mixV4(newV4(0.0f, 0.0f, 0.0f, 1.0f), color, color.w);
+    }
+    return color;
+}
+
+// numSteps is incremented by the number of integration steps taken, for every trace function.
+static v4 traceRay(SkyMap *sky, v3 origin, v3 direction, int *numSteps) {
+    v4 color = newV4(0.0f, 0.0f, 0.0f, 1.0f);
+    v3 velocity = direction;
+    v3 point = origin;
+    v3 prevPoint;
+    float prevSqrNorm;
+    float sqrNorm = dotV3(point, point);
+    v3 crossed = crossV3(point, velocity);
+    float h2 = dotV3(crossed, crossed);
+    bool crossedAccretion = false;
+
+    for (int i=0; i<NUM_ITER; i++) {
+        (*numSteps)++;
+        prevPoint = point;
+        prevSqrNorm = sqrNorm;
+        point = addV3(point, mulV3(STEP, velocity));
+        sqrNorm = dotV3(point, point);
+        v3 accel = mulV3(potentialCoef * h2 / powf(sqrNorm, 2.5f), point);
+        velocity = addV3(velocity, mulV3(STEP, accel));
+
+        if (sqrNorm > skyR2) {
+            color = hitSky(sky, color, crossedAccretion, point);
+            break;
+        } else if (sqrNorm < 1.0f && prevSqrNorm > 1.0f) {
+            color = hitHorizon(color, crossedAccretion);
+            break;
+        } else if (sqrNorm >= dInnerR2 && sqrNorm <= dOuterR2 && ((prevPoint.y > 0.0f && point.y < 0.0f) || (prevPoint.y < 0.0f && point.y > 0.0f))) {
+            crossAccretion(&color, &crossedAccretion, sqrNorm);
+        }
+    }
+    return color;
+}
+
+// Orbital plane of a ray: e1 is radial through origin and e2 the in-plane part of the direction,
+// so the orbit is r(phi) * (cos(phi) e1 + sin(phi) e2). Returns the angle between direction and e1.
+static float orbitalPlane(v3 origin, v3 direction, float *radius, v3 *e1, v3 *e2) {
+    *radius = sqrtf(dotV3(origin, origin));
+    *e1 = mulV3(1.0f / *radius, origin);
+    v3 d = normalizeV3(direction);
+    float cosAlpha = dotV3(d, *e1);
+    v3 perp = subtractV3(d, mulV3(cosAlpha, *e1));
+    float sinAlpha = sqrtf(dotV3(perp, perp));
+    if (sinAlpha > TOLERANCE) {
+        *e2 = mulV3(1.0f / sinAlpha, perp);
+    } else {
+        *e2 = normalizeV3(crossV3(*e1, fabsf(e1->x) < 0.9f ? newV3(1.0f, 0.0f, 0.0f) : newV3(0.0f, 1.0f, 0.0f)));
+    }
+    return atan2f(sinAlpha, cosAlpha);
+}
+
+// First angle in (0, PI] where the orbital plane crosses y = 0, the next ones are PI apart.
+static float discCrossingPhi(v3 e1, v3 e2) {
+    float phi0 = atan2f(-e1.y, e2.y);
+    if (phi0 <= 0.0f) {
+        phi0 += PI;
+    }
+    return phi0;
+}
+
+// Binet equation u'' + u = 1.5 u^2 for u = 1/r as a function of the in-plane angle phi,
+// the photon orbit equation with the horizon at r = 1 like the potential used by traceRay.
+
+#define BINET_MAX_STEP 0.1f
+// Largest relative change of u per step, keeps steps small for nearly radial rays.
+#define BINET_MAX_CHANGE 0.1f
+
+static inline float binetAccel(float u) {
+    return 1.5f * u * u - u;
+}
+
+// Classic RK4 step of (u, du) over h.
+static inline void binetStep(float u, float du, float h, float *nextU, float *nextDu) {
+    float k1u = du, k1du = binetAccel(u);
+    float k2u = du + 0.5f * h * k1du, k2du = binetAccel(u + 0.5f * h * k1u);
+    float k3u = du + 0.5f * h * k2du, k3du = binetAccel(u + 0.5f * h * k2u);
+    float k4u = du + h * k3du, k4du = binetAccel(u + h * k3u);
+    *nextU = u + h / 6.0f * (k1u + 2.0f * k2u + 2.0f * k3u + k4u);
+    *nextDu = du + h / 6.0f * (k1du + 2.0f * k2du + 2.0f * k3du + k4du);
+}
+
+static inline float binetStepSize(float u, float du) {
+    float h = BINET_MAX_STEP;
+    if (fabsf(du) * h > BINET_MAX_CHANGE * u) {
+        h = BINET_MAX_CHANGE * u / fabsf(du);
+    }
+    return h;
+}
+
+// Cubic Hermite interpolation of u at f in [0, 1] of a step of length h.
+static inline float binetInterpolate(float u0, float du0, float u1, float du1, float h, float f) {
+    float f2 = f * f, f3 = f2 * f;
+    return (2.0f * f3 - 3.0f * f2 + 1.0f) * u0 + (f3 - 2.0f * f2 + f) * h * du0 + (-2.0f * f3 + 3.0f * f2) * u1 + (f3 - f2) * h * du1;
+}
+
+// Integrates one planar orbit starting at radius with angle alpha to the radial direction, until it
+// leaves the sky sphere or falls through r = 1. Returns true when it reached one of them, with the
+// angle where it did in endPhi. When phis is not NULL, (phi, 1/r) is recorded after every step.
+static bool integrateBinet(float radius, float alpha, bool *escaped, float *endPhi, float *phis, float *invRadii, int *numSamples) {
+    const float skyU = 1.0f / sqrtf(skyR2);
+    float sinAlpha = sinf(alpha);
+    float u = 1.0f / radius;
+    float phi = 0.0f;
+    int n = 0;
+    if (phis) {
+        phis[n] = phi;
+        invRadii[n] = u;
+        n++;
+    }
+    bool ended = false;
+    if (sinAlpha < TOLERANCE) {
+        // Radial ray, phi never changes.
+        *escaped = alpha < 0.5f * PI;
+        ended = true;
+    } else {
+        float du = -u * cosf(alpha) / sinAlpha;
+        for (int i=0; i<NUM_ITER; i++) {
+            float h = binetStepSize(u, du);
+            float nextU, nextDu;
+            binetStep(u, du, h, &nextU, &nextDu);
+            if (nextU < skyU || nextU > 1.0f) {
+                float target = nextU < skyU ? skyU : 1.0f;
+                phi += h * (u - target) / (u - nextU);
+                u = target;
+                *escaped = nextU < skyU;
+                ended = true;
+            } else {
+                phi += h;
+                u = nextU;
+                du = nextDu;
+            }
+            if (phis) {
+                phis[n] = phi;
+                invRadii[n] = u;
+                n++;
+            }
+            if (ended) {
+                break;
+            }
+        }
+    }
+    if (phis) {
+        *numSamples = n;
+    }
+    *endPhi = phi;
+    return ended;
+}
+
+static v4 traceBinet(SkyMap *sky, v3 origin, v3 direction, int *numSteps) {
+    const float skyU = 1.0f / sqrtf(skyR2);
+    v4 color = newV4(0.0f, 0.0f, 0.0f, 1.0f);
+    bool crossedAccretion = false;
+    float radius;
+    v3 e1, e2;
+    float alpha = orbitalPlane(origin, direction, &radius, &e1, &e2);
+    float sinAlpha = sinf(alpha);
+    if (sinAlpha < TOLERANCE) {
+        return alpha < 0.5f * PI ? hitSky(sky, color, false, e1) : color;
+    }
+    float nextCrossing = discCrossingPhi(e1, e2);
+    float u = 1.0f / radius;
+    float du = -u * cosf(alpha) / sinAlpha;
+    float phi = 0.0f;
+
+    for (int i=0; i<NUM_ITER; i++) {
+        (*numSteps)++;
+        float h = binetStepSize(u, du);
+        float nextU, nextDu;
+        binetStep(u, du, h, &nextU, &nextDu);
+        // Where in the step the orbit leaves, if it does.
+        float end = 1.0f;
+        if (nextU < skyU) {
+            end = (u - skyU) / (u - nextU);
+        } else if (nextU > 1.0f) {
+            end = (u - 1.0f) / (u - nextU);
+        }
+        while (nextCrossing <= phi + end * h) {
+            float crossingU = binetInterpolate(u, du, nextU, nextDu, h, (nextCrossing - phi) / h);
+            float sqrNorm = 1.0f / (crossingU * crossingU);
+            if (sqrNorm >= dInnerR2 && sqrNorm <= dOuterR2) {
+                crossAccretion(&color, &crossedAccretion, sqrNorm);
+            }
+            nextCrossing += PI;
+        }
+        if (nextU < skyU) {
+            float endPhi = phi + end * h;
+            return hitSky(sky, color, crossedAccretion, addV3(mulV3(cosf(endPhi), e1), mulV3(sinf(endPhi), e2)));
+        } else if (nextU > 1.0f) {
+            return hitHorizon(color, crossedAccretion);
+        }
+        phi += h;
+        u = nextU;
+        du = nextDu;
+    }
+    return color;
+}
+
+// Photon state for the 3D integrators, velocity is not normalized, like in traceRay.
+typedef struct {
+    v3 point;
+    v3 velocity;
+    float h2;
+    // 0 for photons, 1 for the massive particles of the trails, which also feel the Newtonian pull.
+    float mass;
+    // Next step size for rk45Step, last accepted step size after it returns.
+    float step;
+    float lastStep;
+} Photon;
+
+static Photon newPhoton(v3 origin, v3 direction) {
+    Photon photon;
+    photon.point = origin;
+    photon.velocity = direction;
+    v3 crossed = crossV3(origin, direction);
+    photon.h2 = dotV3(crossed, crossed);
+    photon.mass = 0.0f;
+    photon.step = STEP;
+    photon.lastStep = 0.0f;
+    return photon;
+}
+
+// M = 1/2 with the horizon at r = 1, the mass term is exactly 0 for photons.
+static inline v3 photonAccel(float h2, float mass, v3 point) {
+    float sqrNorm = dotV3(point, point);
+    return mulV3(potentialCoef * h2 / (sqrNorm * sqrNorm * sqrtf(sqrNorm)) - 0.5f * mass / (sqrNorm * sqrtf(sqrNorm)), point);
+}
+
+// One step of the fixed-step scheme of traceRay.
+static void verletStep(Photon *photon, float step) {
+    photon->point = addV3(photon->point, mulV3(step, photon->velocity));
+    photon->velocity = addV3(photon->velocity, mulV3(step, photonAccel(photon->h2, photon->mass, photon->point)));
+    photon->lastStep = step;
+}
+
+// Dormand-Prince 5(4) with error control. The error is measured relative to tolerance * (1 + |y|)
+// on every component, and the step is also capped at RK45_MAX_STEP * r / |velocity| so steps grow
+// far from the hole. Close to the photon sphere at r = 1.5 the error estimate refines them.
+
+#define RK45_MAX_STEP 0.25f
+#define RK45_MIN_STEP 1e-4f
+#define RK45_MAX_ATTEMPTS 16
+
+static const float rk45A[6][6] = {
+    {1.0f / 5.0f},
+    {3.0f / 40.0f, 9.0f / 40.0f},
+    {44.0f / 45.0f, -56.0f / 15.0f, 32.0f / 9.0f},
+    {19372.0f / 6561.0f, -25360.0f / 2187.0f, 64448.0f / 6561.0f, -212.0f / 729.0f},
+    {9017.0f / 3168.0f, -355.0f / 33.0f, 46732.0f / 5247.0f, 49.0f / 176.0f, -5103.0f / 18656.0f},
+    // 5th order solution, the 7th stage is evaluated there.
+    {35.0f / 384.0f, 0.0f, 500.0f / 1113.0f, 125.0f / 192.0f, -2187.0f / 6784.0f, 11.0f / 84.0f},
+};
+// Difference between the 5th and the embedded 4th order weights.
+static const float rk45E[7] = {71.0f / 57600.0f, 0.0f, -71.0f / 16695.0f, 71.0f / 1920.0f, -17253.0f / 339200.0f, 22.0f / 525.0f, -1.0f / 40.0f};
+
+// Advances photon by one accepted step, returns the number of attempted steps.
+static int rk45Step(Photon *photon, float tolerance) {
+    float radius = sqrtf(dotV3(photon->point, photon->point));
+    float speed = sqrtf(dotV3(photon->velocity, photon->velocity));
+    float maxStep = RK45_MAX_STEP * radius / speed;
+    float h = photon->step < maxStep ? photon->step : maxStep;
+    int attempts = 0;
+    for (;;) {
+        attempts++;
+        // k[i] holds the derivative of (point, velocity), i.e. (velocity, accel).
+        v3 kp[7], kv[7];
+        kp[0] = photon->velocity;
+        kv[0] = photonAccel(photon->h2, photon->mass, photon->point);
+        v3 point, velocity;
+        for (int i=0; i<6; i++) {
+            point = photon->point;
+            velocity = photon->velocity;
+            for (int j=0; j<=i; j++) {
+                point = addV3(point, mulV3(h * rk45A[i][j], kp[j]));
+                velocity = addV3(velocity, mulV3(h * rk45A[i][j], kv[j]));
+            }
+            kp[i + 1] = velocity;
+            kv[i + 1] = photonAccel(photon->h2, photon->mass, point);
+        }
+        // point and velocity hold the 5th order solution.
+        v3 errP = newV3(0.0f, 0.0f, 0.0f), errV = newV3(0.0f, 0.0f, 0.0f);
+        for (int i=0; i<7; i++) {
+            errP = addV3(errP, mulV3(h * rk45E[i], kp[i]));
+            errV = addV3(errV, mulV3(h * rk45E[i], kv[i]));
+        }
+        float scaleP = tolerance * (1.0f + sqrtf(dotV3(point, point)));
+        float scaleV = tolerance * (1.0f + speed);
+        float err = fmaxf(fmaxf(fmaxf(fabsf(errP.x), fabsf(errP.y)), fabsf(errP.z)) / scaleP,
+                          fmaxf(fmaxf(fabsf(errV.x), fabsf(errV.y)), fabsf(errV.z)) / scaleV);
+        float factor = err > 0.0f ? 0.9f * powf(err, -0.2f) : 5.0f;
+        factor = factor < 0.2f ? 0.2f : (factor > 5.0f ? 5.0f : factor);
+        if (err <= 1.0f || h <= RK45_MIN_STEP || attempts >= RK45_MAX_ATTEMPTS) {
+            photon->point = point;
+            photon->velocity = velocity;
+            photon->lastStep = h;
+            photon->step = h * factor;
+            return attempts;
+        }
+        h *= factor;
+    }
+}
+
+// Cubic Hermite interpolation of the position inside a step of length h, f in [0, 1].
+static v3 hermiteV3(v3 p0, v3 v0, v3 p1, v3 v1, float h, float f) {
+    float f2 = f * f, f3 = f2 * f;
+    v3 result = mulV3(2.0f * f3 - 3.0f * f2 + 1.0f, p0);
+    result = addV3(result, mulV3((f3 - 2.0f * f2 + f) * h, v0));
+    result = addV3(result, mulV3(-2.0f * f3 + 3.0f * f2, p1));
+    return addV3(result, mulV3((f3 - f2) * h, v1));
+}
+
+// Derivative of hermiteV3 with respect to f.
+static v3 hermiteTangentV3(v3 p0, v3 v0, v3 p1, v3 v1, float h, float f) {
+    float f2 = f * f;
+    v3 result = mulV3(6.0f * f2 - 6.0f * f, p0);
+    result = addV3(result, mulV3((3.0f * f2 - 4.0f * f + 1.0f) * h, v0));
+    result = addV3(result, mulV3(-6.0f * f2 + 6.0f * f, p1));
+    return addV3(result, mulV3((3.0f * f2 - 2.0f * f) * h, v1));
+}
+
+// Steps are long, so events are located on the Hermite curve of the step from prev to photon with a
+// few Newton iterations, starting from the linear estimate f. plane selects y = 0, otherwise
+// |p|^2 = sqrNorm is solved for.
+static v3 rk45Event(v3 prevPoint, v3 prevVelocity, Photon *photon, float f, bool plane, float sqrNorm) {
+    float h = photon->lastStep;
+    for (int i=0; i<3; i++) {
+        v3 p = hermiteV3(prevPoint, prevVelocity, photon->point, photon->velocity, h, f);
+        v3 dp = hermiteTangentV3(prevPoint, prevVelocity, photon->point, photon->velocity, h, f);
+        float g = plane ? p.y : dotV3(p, p) - sqrNorm;
+        float dg = plane ? dp.y : 2.0f * dotV3(p, dp);
+        if (dg == 0.0f) {
+            break;
+        }
+        f -= g / dg;
+        f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+    }
+    return hermiteV3(prevPoint, prevVelocity, photon->point, photon->velocity, h, f);
+}
+
+static v4 traceRk45(SkyMap *sky, v3 origin, v3 direction, float tolerance, int *numSteps) {
+    v4 color = newV4(0.0f, 0.0f, 0.0f, 1.0f);
+    bool crossedAccretion = false;
+    Photon photon = newPhoton(origin, direction);
+    float sqrNorm = dotV3(origin, origin);
+
+    for (int i=0; i<NUM_ITER; i++) {
+        v3 prevPoint = photon.point;
+        v3 prevVelocity = photon.velocity;
+        float prevSqrNorm = sqrNorm;
+        *numSteps += rk45Step(&photon, tolerance);
+        v3 point = photon.point;
+        sqrNorm = dotV3(point, point);
+
+        // A disc crossing can happen in the same step as the sky exit.
+        bool crossesPlane = (prevPoint.y > 0.0f && point.y < 0.0f) || (prevPoint.y < 0.0f && point.y > 0.0f);
+        if (crossesPlane && !(sqrNorm < 1.0f && prevSqrNorm > 1.0f)) {
+            v3 crossing = rk45Event(prevPoint, prevVelocity, &photon, prevPoint.y / (prevPoint.y - point.y), true, 0.0f);
+            float crossingSqrNorm = dotV3(crossing, crossing);
+            if (crossingSqrNorm >= dInnerR2 && crossingSqrNorm <= dOuterR2) {
+                crossAccretion(&color, &crossedAccretion, crossingSqrNorm);
+            }
+        }
+        if (sqrNorm > skyR2) {
+            float f = (skyR2 - prevSqrNorm) / (sqrNorm - prevSqrNorm);
+            return hitSky(sky, color, crossedAccretion, rk45Event(prevPoint, prevVelocity, &photon, f, false, skyR2));
+        } else if (sqrNorm < 1.0f && prevSqrNorm > 1.0f) {
+            return hitHorizon(color, crossedAccretion);
+        }
+    }
+    return color;
+}
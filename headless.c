@@ -0,0 +1,285 @@
+// Headless CPU renderer for machines without a GPU, renders a single frame to a PNG, a still of any
+// size band by band to a PPM or HDR file, or the frames of a camera path to numbered PNG or HDR files,
+// alone or as the coordinator of worker processes.
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "include/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "include/stb_image_write.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#define PI 3.14159265358979323846f
+
+#include "io.c"
+#include "thread.c"
+#include "decode.c"
+#include "math.c"
+#include "geodesic.c"
+#include "skycache.c"
+#include "camera.c"
+#include "simd.c"
+#include "lut.c"
+#include "cpu.c"
+#include "camerapath.c"
+#include "imagestream.c"
+#include "coordinator.c"
+
+static void usage() {
+    printf("usage: headless [-w width] [-h height] [-sky path] [-o output.png] [-threads n]\n");
+    printf("                [-eye x,y,z] [-yaw degrees] [-pitch degrees]\n");
+    printf("                [-kernel packet|scalar|lut] [-integrator verlet|binet|rk45]\n");
+    printf("                [-tolerance rk45tolerance] [-lut radii,angles,phis]\n");
+    printf("                [-path camera.path] [-fps rate] [-worker index,count|serve] [-band rows]\n");
+    printf("                [-workers n] [-launch command]... [-timeout seconds]\n");
+    exit(-1);
+}
+
+// Renders the frames of path numbered worker modulo numWorkers, so several processes can share a
+// path, to outputPattern formatted with the frame number. Frames already on disk are skipped, and
+// frames are written under a temporary name first, a killed batch resumes where it stopped.
+static void renderCameraPath(CameraPath *path, float fps, int worker, int numWorkers, const char *outputPattern,
+                             ShaderData *shaderData, SkyMap *sky, DeflectionLut *lut, v4 *pixels, int numThreads, CpuKernel kernel) {
+    int numFrames = (int)(cameraPathDuration(path) * fps) + 1;
+    for (int frame=worker; frame<numFrames; frame+=numWorkers) {
+        char framePath[1024];
+        snprintf(framePath, sizeof(framePath), outputPattern, frame);
+        if (fileExists(framePath)) {
+            continue;
+        }
+        Keyframe key = cameraAt(path, frame / fps);
+        applyKeyframe(shaderData, &key);
+        double meanSteps = renderCpu(shaderData, sky, lut, pixels, numThreads, kernel);
+        writeFrame(framePath, pixels, shaderData->nx, shaderData->ny);
+        if (kernel == KERNEL_LUT) {
+            printf("Frame %d of %d\n", frame + 1, numFrames);
+        } else {
+            printf("Frame %d of %d, %.1f mean integration steps per ray\n", frame + 1, numFrames, meanSteps);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int nx = 1920, ny = 1024;
+    char *skyPath = "data/sky8k.jpg";
+    char *outputPath = NULL;
+    char *cameraPathFile = NULL;
+    float fps = 30.0f;
+    int worker = 0, numWorkers = 1;
+    // Rows rendered and written at a time, 0 renders the whole image before writing it.
+    int bandRows = 0;
+    // Take work units from a coordinator on stdin, or coordinate numLocalWorkers copies of this
+    // program and one worker per launch command.
+    bool serving = false;
+    int numLocalWorkers = 0;
+    char *launches[MAX_LAUNCHES];
+    int numLaunches = 0;
+    double unitTimeout = DEFAULT_UNIT_TIMEOUT;
+    bool threadsSet = false;
+    // The arguments passed on to workers, the render settings.
+    char **renderArgs = malloc((argc + 1) * sizeof(char *));
+    int numRenderArgs = 0;
+    int numThreads = getNumCores();
+    bool eyeSet = false;
+    CpuKernel kernel = KERNEL_PACKET;
+    Integrator integrator = INTEGRATOR_VERLET;
+    float tolerance = DEFAULT_RK45_TOLERANCE;
+    int lutRadii = 32, lutAngles = 1024, lutPhis = 64;
+    v3 eye;
+    for (int i=1; i<argc; i++) {
+        if (i + 1 >= argc) {
+            usage();
+        }
+        char *arg = argv[i];
+        char *value = argv[++i];
+        if (strcmp(arg, "-o") && strcmp(arg, "-worker") && strcmp(arg, "-workers") && strcmp(arg, "-launch") && strcmp(arg, "-timeout")) {
+            renderArgs[numRenderArgs++] = arg;
+            renderArgs[numRenderArgs++] = value;
+        }
+        if (!strcmp(arg, "-w")) {
+            nx = atoi(value);
+        } else if (!strcmp(arg, "-h")) {
+            ny = atoi(value);
+        } else if (!strcmp(arg, "-sky")) {
+            skyPath = value;
+        } else if (!strcmp(arg, "-o")) {
+            outputPath = value;
+        } else if (!strcmp(arg, "-threads")) {
+            numThreads = atoi(value);
+            threadsSet = true;
+        } else if (!strcmp(arg, "-eye")) {
+            if (sscanf(value, "%f,%f,%f", &eye.x, &eye.y, &eye.z) != 3) {
+                usage();
+            }
+            eyeSet = true;
+        } else if (!strcmp(arg, "-kernel")) {
+            if (!strcmp(value, "packet")) {
+                kernel = KERNEL_PACKET;
+            } else if (!strcmp(value, "scalar")) {
+                kernel = KERNEL_SCALAR;
+            } else if (!strcmp(value, "lut")) {
+                kernel = KERNEL_LUT;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(arg, "-integrator")) {
+            if (!strcmp(value, "verlet")) {
+                integrator = INTEGRATOR_VERLET;
+            } else if (!strcmp(value, "binet")) {
+                integrator = INTEGRATOR_BINET;
+            } else if (!strcmp(value, "rk45")) {
+                integrator = INTEGRATOR_RK45;
+            } else {
+                usage();
+            }
+        } else if (!strcmp(arg, "-tolerance")) {
+            tolerance = (float)atof(value);
+        } else if (!strcmp(arg, "-lut")) {
+            if (sscanf(value, "%d,%d,%d", &lutRadii, &lutAngles, &lutPhis) != 3) {
+                usage();
+            }
+        } else if (!strcmp(arg, "-path")) {
+            cameraPathFile = value;
+        } else if (!strcmp(arg, "-band")) {
+            bandRows = atoi(value);
+        } else if (!strcmp(arg, "-fps")) {
+            fps = (float)atof(value);
+        } else if (!strcmp(arg, "-worker")) {
+            if (!strcmp(value, "serve")) {
+                serving = true;
+            } else if (sscanf(value, "%d,%d", &worker, &numWorkers) != 2) {
+                usage();
+            }
+        } else if (!strcmp(arg, "-workers")) {
+            numLocalWorkers = atoi(value);
+        } else if (!strcmp(arg, "-launch") && strcmp(arg, "-timeout")) {
+            if (numLaunches == MAX_LAUNCHES) {
+                usage();
+            }
+            launches[numLaunches++] = value;
+        } else if (!strcmp(arg, "-timeout")) {
+            unitTimeout = atof(value);
+        } else if (!strcmp(arg, "-yaw")) {
+            yaw = (float)atof(value);
+        } else if (!strcmp(arg, "-pitch")) {
+            pitch = (float)atof(value);
+        } else {
+            usage();
+        }
+    }
+    bool coordinating = numLocalWorkers > 0 || numLaunches > 0;
+    if (nx <= 0 || ny <= 0 || numThreads <= 0 || tolerance <= 0.0f || fps <= 0.0f || numWorkers <= 0 || worker < 0 || worker >= numWorkers ||
+        bandRows < 0 || numLocalWorkers < 0 || unitTimeout <= 0.0 || (bandRows > 0 && cameraPathFile && !coordinating && !serving) ||
+        (coordinating && (serving || numWorkers > 1))) {
+        usage();
+    }
+    FILE *protocol = serving ? openProtocol() : NULL;
+    if (!outputPath) {
+        outputPath = cameraPathFile ? "frame%05d.png" : "render.png";
+    } else if (cameraPathFile && !strchr(outputPath, '%')) {
+        printf("The output of a camera path needs a frame number, like frame%%05d.png\n");
+        exit(-1);
+    }
+    ImageStream stream = {0};
+    if (bandRows > 0 && !cameraPathFile && !serving && !openImageStream(&stream, outputPath, nx, ny)) {
+        printf("Could not create %s, rendering in bands writes .ppm or .hdr files\n", outputPath);
+        exit(-1);
+    }
+    // Read first, a bad path shouldn't wait for the sky.
+    CameraPath cameraPath = {0};
+    if (cameraPathFile) {
+        cameraPath = readCameraPath(cameraPathFile);
+    }
+    if (coordinating) {
+        coordinateRender(&cameraPath, fps, nx, ny, bandRows, outputPath, bandRows > 0 && !cameraPathFile ? &stream : NULL, kernel != KERNEL_LUT, unitTimeout,
+                         workerArguments(argv[0], renderArgs, numRenderArgs, numLocalWorkers, threadsSet, launches, numLaunches),
+                         numLocalWorkers + numLaunches);
+        if (bandRows > 0 && !cameraPathFile && !closeImageStream(&stream)) {
+            printf("Could not write %s\n", outputPath);
+            exit(-1);
+        }
+        return 0;
+    }
+
+    // The cache of the viewer's equirectangular RGBA8 map holds the texels as decoded, they are
+    // used in place.
+    SkySource skySource = newSkySource(skyPath, SKY_RGBA8, 0);
+    readSkySource(&skySource);
+    if (!skySource.texels) {
+        printf("Could not load sky map %s\n", skyPath);
+        exit(-1);
+    }
+    if (!skySource.cached) {
+        SkyCacheHeader cacheHeader = skySource.header;
+        cacheHeader.width = skySource.width;
+        cacheHeader.height = skySource.height;
+        cacheHeader.numLevels = 1;
+        FILE *file = createSkyCache(skyPath, &cacheHeader);
+        if (file) {
+            fwrite(skySource.texels, skyCacheImageSize(&cacheHeader, 0), 1, file);
+            closeSkyCache(file, skyPath, &cacheHeader);
+        }
+    }
+    SkyMap sky;
+    sky.width = skySource.width;
+    sky.height = skySource.height;
+    sky.texels = skySource.texels;
+
+    ShaderData shaderData = initShaderData(nx, ny, sky.width, sky.height);
+    if (eyeSet) {
+        cP = eye;
+        updateCamera();
+        shaderData.eye = cP;
+        shaderData.u = fromV3(u);
+        shaderData.v = fromV3(v);
+        shaderData.w = fromV3(w);
+    }
+    shaderData.integrator = integrator;
+    shaderData.tolerance = tolerance;
+
+    DeflectionLut lut = {0};
+    if (kernel == KERNEL_LUT) {
+        lut = buildLut(integrator, tolerance, lutRadii, lutAngles, lutPhis, 2.0f, sqrtf(skyR2), numThreads);
+    }
+
+    v4 *pixels = malloc((size_t)nx * (bandRows > 0 && bandRows < ny ? bandRows : ny) * sizeof(v4));
+    if (serving) {
+        serveWorkUnits(protocol, &cameraPath, fps, &shaderData, &sky, &lut, pixels, bandRows > 0 && bandRows < ny ? bandRows : ny, numThreads, kernel);
+    } else if (bandRows > 0) {
+        // Top band first, the rows are written in file order as they are rendered.
+        double totalSteps = 0.0;
+        for (int lastRow=ny; lastRow>0; lastRow-=bandRows) {
+            int firstRow = lastRow > bandRows ? lastRow - bandRows : 0;
+            totalSteps += renderCpuRows(&shaderData, &sky, &lut, pixels, firstRow, lastRow - firstRow, numThreads, kernel) * (lastRow - firstRow);
+            writeImageRows(&stream, pixels, lastRow - firstRow);
+        }
+        if (kernel != KERNEL_LUT) {
+            printf("Mean integration steps per ray: %.1f\n", totalSteps / ny);
+        }
+        if (!closeImageStream(&stream)) {
+            printf("Could not write %s\n", outputPath);
+            exit(-1);
+        }
+    } else if (cameraPathFile) {
+        renderCameraPath(&cameraPath, fps, worker, numWorkers, outputPath, &shaderData, &sky, &lut, pixels, numThreads, kernel);
+    } else {
+        double meanSteps = renderCpu(&shaderData, &sky, &lut, pixels, numThreads, kernel);
+        if (kernel != KERNEL_LUT) {
+            printf("Mean integration steps per ray: %.1f\n", meanSteps);
+        }
+        writeImage(outputPath, pixels, nx, ny);
+    }
+    if (kernel == KERNEL_LUT) {
+        freeLut(&lut);
+    }
+    freeSkySource(&skySource);
+    free(pixels);
+    return 0;
+}
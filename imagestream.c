@@ -0,0 +1,159 @@
+// Output of the headless renderer. Whole images go through stb_image_write, stills too large to be
+// held whole are written a band of rows at a time: binary PPM for 8 bits and Radiance HDR for floats
+// both store their rows top first with nothing to patch later, so each band goes to disk as soon as
+// it is rendered.
+
+typedef struct {
+    FILE *file;
+    bool hdr;
+    int nx;
+    int ny;
+    int rowsWritten;
+    unsigned char *row;
+} ImageStream;
+
+// Returns false when path isn't a .ppm or .hdr file or can't be created.
+static bool openImageStream(ImageStream *stream, const char *path, int nx, int ny) {
+    const char *extension = strrchr(path, '.');
+    if (!extension || (strcmp(extension, ".ppm") && strcmp(extension, ".hdr"))) {
+        return false;
+    }
+    stream->file = fopen(path, "wb");
+    if (!stream->file) {
+        return false;
+    }
+    stream->hdr = !strcmp(extension, ".hdr");
+    stream->nx = nx;
+    stream->ny = ny;
+    stream->rowsWritten = 0;
+    if (stream->hdr) {
+        fprintf(stream->file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n", ny, nx);
+        stream->row = malloc((size_t)nx * 4);
+    } else {
+        fprintf(stream->file, "P6\n%d %d\n255\n", nx, ny);
+        stream->row = malloc((size_t)nx * 3);
+    }
+    return true;
+}
+
+static unsigned char toByte(float x) {
+    if (x <= 0.0f) {
+        return 0;
+    } else if (x >= 1.0f) {
+        return 255;
+    }
+    return (unsigned char)(255.0f * x + 0.5f);
+}
+
+static void toRgbe(v4 color, unsigned char *rgbe) {
+    float maxComponent = fmaxf(color.x, fmaxf(color.y, color.z));
+    if (maxComponent < 1e-32f) {
+        rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+        return;
+    }
+    int exponent;
+    float scale = frexpf(maxComponent, &exponent) * 256.0f / maxComponent;
+    rgbe[0] = (unsigned char)(fmaxf(color.x, 0.0f) * scale);
+    rgbe[1] = (unsigned char)(fmaxf(color.y, 0.0f) * scale);
+    rgbe[2] = (unsigned char)(fmaxf(color.z, 0.0f) * scale);
+    rgbe[3] = (unsigned char)(exponent + 128);
+}
+
+// Scanlines between 8 and 32767 pixels wide have to be in the run length layout, or a flat one
+// starting with 2, 2 would be taken for it. Only literal runs are written, one channel after the
+// other, wider ones are flat.
+static void writeHdrRow(ImageStream *stream) {
+    int nx = stream->nx;
+    if (nx < 8 || nx > 32767) {
+        fwrite(stream->row, 4, nx, stream->file);
+        return;
+    }
+    unsigned char header[4] = {2, 2, (unsigned char)(nx >> 8), (unsigned char)(nx & 0xff)};
+    fwrite(header, 1, 4, stream->file);
+    unsigned char run[129];
+    for (int channel=0; channel<4; channel++) {
+        for (int x=0; x<nx; x+=128) {
+            int count = nx - x < 128 ? nx - x : 128;
+            run[0] = (unsigned char)count;
+            for (int i=0; i<count; i++) {
+                run[1 + i] = stream->row[4 * (x + i) + channel];
+            }
+            fwrite(run, 1, 1 + count, stream->file);
+        }
+    }
+}
+
+// Writes the next numRows rows of the image from pixels, which holds them bottom row first like
+// renderCpuRows.
+static void writeImageRows(ImageStream *stream, v4 *pixels, int numRows) {
+    for (int y=numRows-1; y>=0; y--) {
+        v4 *row = pixels + (size_t)y * stream->nx;
+        for (int x=0; x<stream->nx; x++) {
+            if (stream->hdr) {
+                toRgbe(row[x], stream->row + 4 * x);
+            } else {
+                stream->row[3*x+0] = toByte(row[x].x);
+                stream->row[3*x+1] = toByte(row[x].y);
+                stream->row[3*x+2] = toByte(row[x].z);
+            }
+        }
+        if (stream->hdr) {
+            writeHdrRow(stream);
+        } else {
+            fwrite(stream->row, 3, stream->nx, stream->file);
+        }
+    }
+    stream->rowsWritten += numRows;
+}
+
+// Returns false when writing failed somewhere along the way.
+static bool closeImageStream(ImageStream *stream) {
+    bool written = !ferror(stream->file) && stream->rowsWritten == stream->ny;
+    written = fclose(stream->file) == 0 && written;
+    free(stream->row);
+    return written;
+}
+
+// Writes a .hdr file as floats and anything else as a PNG.
+static void writeImage(const char *path, v4 *pixels, int nx, int ny) {
+    // Row 0 is the bottom of the frame, like the OpenGL output texture.
+    stbi_flip_vertically_on_write(1);
+    const char *extension = strrchr(path, '.');
+    int written;
+    if (extension && !strcmp(extension, ".hdr")) {
+        float *image = malloc((size_t)nx * ny * 3 * sizeof(float));
+        for (size_t i=0; i<(size_t)nx * ny; i++) {
+            image[3*i+0] = pixels[i].x;
+            image[3*i+1] = pixels[i].y;
+            image[3*i+2] = pixels[i].z;
+        }
+        written = stbi_write_hdr(path, nx, ny, 3, image);
+        free(image);
+    } else {
+        unsigned char *image = malloc((size_t)nx * ny * 3);
+        for (size_t i=0; i<(size_t)nx * ny; i++) {
+            image[3*i+0] = toByte(pixels[i].x);
+            image[3*i+1] = toByte(pixels[i].y);
+            image[3*i+2] = toByte(pixels[i].z);
+        }
+        written = stbi_write_png(path, nx, ny, 3, image, 3 * nx);
+        free(image);
+    }
+    if (!written) {
+        printf("Could not write %s\n", path);
+        exit(-1);
+    }
+}
+
+// Writes the frame under a temporary name and renames it, a file named framePath is always complete.
+static void writeFrame(const char *framePath, v4 *pixels, int nx, int ny) {
+    char tmpPath[1040];
+    // The extension picks the format, keep it last.
+    const char *extension = strrchr(framePath, '.');
+    snprintf(tmpPath, sizeof(tmpPath), "%.*s.tmp%s", extension ? (int)(extension - framePath) : (int)strlen(framePath), framePath, extension ? extension : "");
+    writeImage(tmpPath, pixels, nx, ny);
+    if (rename(tmpPath, framePath) != 0) {
+        printf("Could not rename %s to %s\n", tmpPath, framePath);
+        exit(-1);
+    }
+}
@@ -1,14 +1,179 @@
-void getFileContents(const char* path, char* contents, int* len) {
-    FILE* file = fopen(path, "r");
-    fseek(file, 0, SEEK_END);
-    int fsize = ftell(file);
-    if(fsize > *len) {
-        printf("getFileContents was given a buffer which is too small for the file size\n");
-        printf("Necessary file size is %d\n", fsize);
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <unistd.h>
+#endif
+
+// Read only view of a whole file, inputs are mapped rather than read into buffers.
+typedef struct {
+    void *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+// Maps the file at path, returns false if it can't be opened.
+static bool mapFile(const char *path, MappedFile *file) {
+    memset(file, 0, sizeof(*file));
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    GetFileSizeEx(handle, &size);
+    file->size = (size_t)size.QuadPart;
+    if (file->size > 0) {
+        file->mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        file->data = file->mapping ? MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    }
+    CloseHandle(handle);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    fstat(fd, &info);
+    file->size = (size_t)info.st_size;
+    if (file->size > 0) {
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED) {
+            file->data = NULL;
+        }
+    }
+    close(fd);
+#endif
+    if (file->size > 0 && !file->data) {
+        printf("Could not map %s\n", path);
         exit(-1);
     }
-    *len = fsize;
-    fseek(file, 0, SEEK_SET);
-    fread(contents, fsize, 1, file);
-    fclose(file);
-};
+    return true;
+}
+
+static void unmapFile(MappedFile *file) {
+#ifdef _WIN32
+    if (file->data) {
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+    }
+#else
+    if (file->data) {
+        munmap(file->data, file->size);
+    }
+#endif
+    memset(file, 0, sizeof(*file));
+}
+
+// fseek with 64-bit offsets, for files over 2 GB.
+static bool seekFile(FILE *file, int64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+#endif
+}
+
+static bool fileExists(const char *path) {
+    struct stat info;
+    return stat(path, &info) == 0;
+}
+
+static int processId() {
+#ifdef _WIN32
+    return (int)GetCurrentProcessId();
+#else
+    return (int)getpid();
+#endif
+}
+
+// -1 when there is no file at path.
+static int64_t fileSize(const char *path) {
+#ifdef _WIN32
+    struct _stat64 info;
+    return _stat64(path, &info) == 0 ? (int64_t)info.st_size : -1;
+#else
+    struct stat info;
+    return stat(path, &info) == 0 ? (int64_t)info.st_size : -1;
+#endif
+}
+
+// Renames from to to, replacing it. Windows doesn't rename over an existing file, it is removed first.
+static bool replaceFile(const char *from, const char *to) {
+#ifdef _WIN32
+    remove(to);
+#endif
+    return rename(from, to) == 0;
+}
+
+// Creates the directory at path if it doesn't exist yet.
+static void makeDirectory(const char *path) {
+#ifdef _WIN32
+    CreateDirectoryA(path, NULL);
+#else
+    mkdir(path, 0755);
+#endif
+}
+
+// Notifications of the files written in a directory, inotify on Linux. Elsewhere than Windows and
+// Linux nothing is ever reported.
+typedef struct {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    int fd;
+#endif
+} DirectoryWatch;
+
+static DirectoryWatch watchDirectory(const char *path) {
+    DirectoryWatch watch;
+#ifdef _WIN32
+    watch.handle = FindFirstChangeNotificationA(path, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+#elif defined(__linux__)
+    watch.fd = inotify_init1(IN_NONBLOCK);
+    // Editors either write the file in place or rename a new one over it.
+    if (watch.fd >= 0 && inotify_add_watch(watch.fd, path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(watch.fd);
+        watch.fd = -1;
+    }
+#else
+    watch.fd = -1;
+#endif
+    return watch;
+}
+
+// Whether a file whose name ends with suffix was written since the last call, without waiting.
+// Windows doesn't say which file it was.
+static bool directoryChanged(DirectoryWatch *watch, const char *suffix) {
+    bool changed = false;
+#ifdef _WIN32
+    while (watch->handle != INVALID_HANDLE_VALUE && WaitForSingleObject(watch->handle, 0) == WAIT_OBJECT_0) {
+        changed = true;
+        FindNextChangeNotification(watch->handle);
+    }
+#elif defined(__linux__)
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while (watch->fd >= 0 && (len = read(watch->fd, events, sizeof(events))) > 0) {
+        for (char *next = events; next < events + len; ) {
+            struct inotify_event *event = (struct inotify_event *)next;
+            size_t nameLen = event->len > 0 ? strlen(event->name) : 0;
+            size_t suffixLen = strlen(suffix);
+            if (nameLen >= suffixLen && !strcmp(event->name + nameLen - suffixLen, suffix)) {
+                changed = true;
+            }
+            next += sizeof(struct inotify_event) + event->len;
+        }
+    }
+#endif
+    return changed;
+}
@@ -0,0 +1,222 @@
+// Deflection lookup table. The metric is spherically symmetric, so a ray only depends on the
+// camera radius and on the angle alpha between its direction and the outward radial direction.
+// Each entry integrates one ray in its orbital plane, with the Verlet scheme of traceRay, the Binet
+// equation or RK45, and stores how it ends, the in-plane angle phi where it ends and 1/r sampled
+// uniformly in phi. Pixels are then reconstructed by rotating that planar orbit into the ray's
+// orbital plane: the sky exit direction comes from the end angle and disc crossings from 1/r at the
+// angles where the orbital plane meets y = 0.
+
+typedef enum {
+    FATE_SKY,
+    FATE_HORIZON,
+    FATE_ORBITING
+} RayFate;
+
+typedef struct {
+    int numRadii;
+    int numAngles;
+    int numPhi;
+    float minRadius;
+    float maxRadius;
+    // numRadii * numAngles entries, radius major.
+    unsigned char *fate;
+    float *endPhi;
+    // numPhi samples of 1/r per entry, on [0, endPhi].
+    float *invRadius;
+    Integrator integrator;
+    float tolerance;
+    volatile int nextRow;
+} DeflectionLut;
+
+// Integrates one ray in the plane z = 0, recording (phi, 1/r) after every step.
+static RayFate integratePlanar(Integrator integrator, float tolerance, float radius, float alpha, float *phis, float *invRadii, int *numSamples) {
+    if (integrator == INTEGRATOR_BINET) {
+        bool escaped;
+        float endPhi;
+        if (!integrateBinet(radius, alpha, &escaped, &endPhi, phis, invRadii, numSamples)) {
+            return FATE_ORBITING;
+        }
+        return escaped ? FATE_SKY : FATE_HORIZON;
+    }
+
+    Photon photon = newPhoton(newV3(radius, 0.0f, 0.0f), newV3(cosf(alpha), sinf(alpha), 0.0f));
+    float sqrNorm = radius * radius;
+    float phi = 0.0f;
+    RayFate fate = FATE_ORBITING;
+    phis[0] = 0.0f;
+    invRadii[0] = 1.0f / radius;
+    int n = 1;
+    for (int i=0; i<NUM_ITER; i++) {
+        v3 prevPoint = photon.point;
+        v3 prevVelocity = photon.velocity;
+        float prevSqrNorm = sqrNorm;
+        if (integrator == INTEGRATOR_RK45) {
+            rk45Step(&photon, tolerance);
+        } else {
+            verletStep(&photon, STEP);
+        }
+        v3 point = photon.point;
+        sqrNorm = dotV3(point, point);
+        if (sqrNorm > skyR2) {
+            fate = FATE_SKY;
+        } else if (sqrNorm < 1.0f && prevSqrNorm > 1.0f) {
+            fate = FATE_HORIZON;
+        }
+        if (integrator == INTEGRATOR_RK45 && fate != FATE_ORBITING) {
+            // Steps are long, the orbit ends where it crosses the sphere, like in traceRk45.
+            float eventSqrNorm = fate == FATE_SKY ? skyR2 : 1.0f;
+            point = rk45Event(prevPoint, prevVelocity, &photon, (eventSqrNorm - prevSqrNorm) / (sqrNorm - prevSqrNorm), false, eventSqrNorm);
+        }
+        phi += atan2f(prevPoint.x * point.y - prevPoint.y * point.x, dotV3(prevPoint, point));
+        phis[n] = phi;
+        invRadii[n] = 1.0f / sqrtf(dotV3(point, point));
+        n++;
+        if (fate != FATE_ORBITING) {
+            break;
+        }
+    }
+    *numSamples = n;
+    return fate;
+}
+
+static void buildLutRow(DeflectionLut *lut, int row, float *phis, float *invRadii) {
+    float radius = lut->minRadius + (lut->maxRadius - lut->minRadius) * row / (lut->numRadii - 1);
+    for (int a=0; a<lut->numAngles; a++) {
+        float alpha = PI * a / (lut->numAngles - 1);
+        int numSamples = 0;
+        RayFate fate = integratePlanar(lut->integrator, lut->tolerance, radius, alpha, phis, invRadii, &numSamples);
+        size_t entry = (size_t)row * lut->numAngles + a;
+        float endPhi = phis[numSamples - 1];
+        lut->fate[entry] = (unsigned char)fate;
+        lut->endPhi[entry] = endPhi;
+        // Resample 1/r uniformly in phi, phi never decreases along the orbit.
+        float *out = lut->invRadius + entry * lut->numPhi;
+        int j = 0;
+        for (int k=0; k<lut->numPhi; k++) {
+            float phi = endPhi * k / (lut->numPhi - 1);
+            while (j < numSamples - 2 && phis[j + 1] < phi) {
+                j++;
+            }
+            float dPhi = phis[j + 1] - phis[j];
+            float f = dPhi > 0.0f ? (phi - phis[j]) / dPhi : 0.0f;
+            f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+            out[k] = invRadii[j] + (invRadii[j + 1] - invRadii[j]) * f;
+        }
+    }
+}
+
+static void buildLutWorker(void *arg) {
+    DeflectionLut *lut = (DeflectionLut *)arg;
+    float *phis = malloc((NUM_ITER + 1) * sizeof(float));
+    float *invRadii = malloc((NUM_ITER + 1) * sizeof(float));
+    for (;;) {
+        int row = atomicFetchAdd(&lut->nextRow, 1);
+        if (row >= lut->numRadii) {
+            break;
+        }
+        buildLutRow(lut, row, phis, invRadii);
+    }
+    free(phis);
+    free(invRadii);
+}
+
+static DeflectionLut buildLut(Integrator integrator, float tolerance, int numRadii, int numAngles, int numPhi, float minRadius, float maxRadius, int numThreads) {
+    DeflectionLut lut;
+    if (numRadii < 2 || numAngles < 2 || numPhi < 2 || minRadius >= maxRadius) {
+        printf("Invalid deflection table size\n");
+        exit(-1);
+    }
+    lut.numRadii = numRadii;
+    lut.numAngles = numAngles;
+    lut.numPhi = numPhi;
+    lut.minRadius = minRadius;
+    lut.maxRadius = maxRadius;
+    lut.integrator = integrator;
+    lut.tolerance = tolerance;
+    size_t numEntries = (size_t)numRadii * numAngles;
+    lut.fate = malloc(numEntries);
+    lut.endPhi = malloc(numEntries * sizeof(float));
+    lut.invRadius = malloc(numEntries * numPhi * sizeof(float));
+    lut.nextRow = 0;
+    runThreads(numThreads, buildLutWorker, &lut);
+    return lut;
+}
+
+static void freeLut(DeflectionLut *lut) {
+    free(lut->fate);
+    free(lut->endPhi);
+    free(lut->invRadius);
+}
+
+static float lutInvRadius(DeflectionLut *lut, size_t entry, float phi) {
+    float endPhi = lut->endPhi[entry];
+    float *samples = lut->invRadius + entry * lut->numPhi;
+    if (endPhi <= 0.0f) {
+        return samples[0];
+    }
+    float x = phi / endPhi * (lut->numPhi - 1);
+    if (x >= lut->numPhi - 1) {
+        return samples[lut->numPhi - 1];
+    }
+    int k = (int)x;
+    float f = x - k;
+    return samples[k] + (samples[k + 1] - samples[k]) * f;
+}
+
+// Returns false when the camera is outside of the radii covered by the table.
+static bool traceLut(DeflectionLut *lut, SkyMap *sky, v3 origin, v3 direction, v4 *result) {
+    float radius = sqrtf(dotV3(origin, origin));
+    float fr = (radius - lut->minRadius) / (lut->maxRadius - lut->minRadius) * (lut->numRadii - 1);
+    if (fr < 0.0f || fr > lut->numRadii - 1) {
+        return false;
+    }
+
+    v3 e1, e2;
+    float alpha = orbitalPlane(origin, direction, &radius, &e1, &e2);
+    float fa = alpha / PI * (lut->numAngles - 1);
+
+    int r0 = (int)fr, a0 = (int)fa;
+    int r1 = r0 + 1 < lut->numRadii ? r0 + 1 : r0;
+    int a1 = a0 + 1 < lut->numAngles ? a0 + 1 : a0;
+    float tr = fr - r0, ta = fa - a0;
+    size_t entries[4];
+    float weights[4];
+    entries[0] = (size_t)r0 * lut->numAngles + a0; weights[0] = (1.0f - tr) * (1.0f - ta);
+    entries[1] = (size_t)r0 * lut->numAngles + a1; weights[1] = (1.0f - tr) * ta;
+    entries[2] = (size_t)r1 * lut->numAngles + a0; weights[2] = tr * (1.0f - ta);
+    entries[3] = (size_t)r1 * lut->numAngles + a1; weights[3] = tr * ta;
+    int numEntries = 4;
+    unsigned char fate = lut->fate[entries[0]];
+    if (fate != lut->fate[entries[1]] || fate != lut->fate[entries[2]] || fate != lut->fate[entries[3]]) {
+        // Don't blend across the capture boundary, use the nearest entry.
+        entries[0] = (size_t)(tr < 0.5f ? r0 : r1) * lut->numAngles + (ta < 0.5f ? a0 : a1);
+        weights[0] = 1.0f;
+        numEntries = 1;
+        fate = lut->fate[entries[0]];
+    }
+    float endPhi = 0.0f;
+    for (int i=0; i<numEntries; i++) {
+        endPhi += weights[i] * lut->endPhi[entries[i]];
+    }
+
+    v4 color = newV4(0.0f, 0.0f, 0.0f, 1.0f);
+    bool crossedAccretion = false;
+    for (float phi=discCrossingPhi(e1, e2); phi<endPhi; phi+=PI) {
+        float invRadius = 0.0f;
+        for (int i=0; i<numEntries; i++) {
+            invRadius += weights[i] * lutInvRadius(lut, entries[i], phi);
+        }
+        float sqrNorm = 1.0f / (invRadius * invRadius);
+        if (sqrNorm >= dInnerR2 && sqrNorm <= dOuterR2) {
+            crossAccretion(&color, &crossedAccretion, sqrNorm);
+        }
+    }
+
+    if (fate == FATE_SKY) {
+        color = hitSky(sky, color, crossedAccretion, addV3(mulV3(cosf(endPhi), e1), mulV3(sinf(endPhi), e2)));
+    } else if (fate == FATE_HORIZON) {
+        color = hitHorizon(color, crossedAccretion);
+    }
+    *result = color;
+    return true;
+}
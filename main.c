@@ -1,3 +1,7 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "include/glad/glad.h"
 #define GLFW_DLL
 #include "include/GLFW/glfw3.h"
@@ -7,76 +11,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
 
 #define PI 3.14159265358979323846f
 
 #include "io.c"
+#include "thread.c"
+#include "decode.c"
 #include "math.c"
+#include "geodesic.c"
 #include "opengl.c"
+#include "streambuffer.c"
+#include "camera.c"
+#include "cubecache.c"
+#include "progressive.c"
+#include "reprojection.c"
+#include "resolution.c"
+#include "skycache.c"
+#include "sky.c"
+#include "skytiles.c"
+#include "trails.c"
+
+static GLuint rayTracerProgram(int integrator) {
+    char *path = "shaders/compute.glsl";
+    return kernelProgram("rayTracer", &path, 1, integrator);
+}
 
-#define NX 1920
-#define NY 1024
-#define TRAIL_LEN 1000
-const float skyR2 = 30.0f * 30.0f;
-
-const float potentialCoef = -1.5f;
+// The main thread reads the input and steps the simulation SIM_RATE times per second, the window
+// events arrive there. Rendering runs on its own thread and takes the latest camera and the queued
+// trail steps, so the simulation is deterministic and input isn't held up by slow frames.
+#define SIM_RATE 120
 
-const float oneRadian = PI / 180.0f;
-const float fovy = 45.0f;
-const float speed = 0.1f;
+// Distance moved per simulation tick, 12 per second.
+const float speed = 12.0f / SIM_RATE;
 const float sensitivity = 0.05f;
 
-float yaw = -90.f, pitch = 0.0f;
-//float yaw = -90.f, pitch = -11.0f;
-double lastX = NX / 2, lastY = NY / 2;
+double lastX, lastY;
 bool cursorPosSet = false;
 
-v3 cP, cFront, cRight, cUp, wUp;
-v3 u, v, w;
-
-static void updateCamera() {
-    cFront.x = cosf(pitch * oneRadian) * cosf(yaw * oneRadian);
-    cFront.y = sinf(pitch * oneRadian);
-    cFront.z = cosf(pitch * oneRadian) * sinf(yaw * oneRadian);
-    cFront = normalizeV3(cFront);
-    cRight = normalizeV3(crossV3(cFront, wUp));
-    cUp = normalizeV3(crossV3(cRight, cFront));
-    w = normalizeV3(subtractV3(cP, addV3(cP, cFront)));
-    u = normalizeV3(crossV3(cUp, w));
-    v = crossV3(w, u);
-}
-
-typedef struct {
-    float nx;
-    float ny;
-    float xSkyMap;
-    float ySkyMap;
-    v3 eye;
-    float halfHeight;
-    v4 u;
-    v4 v;
-    v4 w;
-} ShaderData;
-
-static ShaderData initShaderData(int nx, int ny, int xSkyMap, int ySkyMap) {
-    ShaderData shaderData;
-    cP = newV3(0.0f, 0.0f, 20.0f);
-    wUp = newV3(0.2f, 1.0f, 0.0f);
-    updateCamera();
-    shaderData.nx = (float)nx;
-    shaderData.ny = (float)ny;
-    shaderData.xSkyMap = (float)xSkyMap;
-    shaderData.ySkyMap = (float)ySkyMap;
-    shaderData.eye = cP;
-    shaderData.halfHeight = tanf(fovy * PI / (180.f * 2.0f));
-    shaderData.u = fromV3(u);
-    shaderData.v = fromV3(v);
-    shaderData.w = fromV3(w);
-    return shaderData;
-}
-
-static void actOnInput(GLFWwindow *window, ShaderData *shaderData) {
+static void actOnInput(GLFWwindow *window, CameraState *camera) {
     double xpos, ypos;
     glfwGetCursorPos(window, &xpos, &ypos);
     if (!cursorPosSet) {
@@ -110,14 +84,286 @@ static void actOnInput(GLFWwindow *window, ShaderData *shaderData) {
     if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
         cP = addV3(cP, mulV3(speed, cRight));
     }
+    if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS) {
+        camera->integrator = INTEGRATOR_VERLET;
+    }
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS) {
+        camera->integrator = INTEGRATOR_BINET;
+    }
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
+        camera->integrator = INTEGRATOR_RK45;
+    }
+
+    camera->eye = cP;
+    camera->u = u;
+    camera->v = v;
+    camera->w = w;
+}
+
+typedef struct {
+    GLFWwindow *window;
+    CameraState camera;
+    CameraHandoff handoff;
+    Trails *trails;
+    bool firing;
+    int tick;
+} Simulation;
+
+static void simulate(Simulation *simulation) {
+    CameraState camera = simulation->camera;
+    actOnInput(simulation->window, &camera);
+    if (memcmp(&camera, &simulation->camera, sizeof(camera))) {
+        simulation->camera = camera;
+        publishCamera(&simulation->handoff, &camera);
+    }
+    bool fire = glfwGetKey(simulation->window, GLFW_KEY_F) == GLFW_PRESS;
+    if (fire && !simulation->firing) {
+        launchTrails(simulation->trails, cP, cFront, cRight, cUp, simulation->tick);
+    }
+    simulation->firing = fire;
+    advanceTrails(simulation->trails, simulation->tick, simulation->camera.integrator);
+    simulation->tick++;
+}
+
+// Everything the render thread works with, the GL context is current there.
+typedef struct {
+    GLFWwindow *window;
+    Simulation *simulation;
+    int width;
+    int height;
+    GLuint resultsTextureId;
+    SkyTiles skyTiles;
+    CubeCache cubeCache;
+    Progressive progressive;
+    Reprojection reprojection;
+    DynamicResolution resolution;
+    ShaderData shaderData;
+    StreamBuffer ssbo;
+    volatile int quit;
+} Renderer;
+
+#define SSBO_LOCATION 0
+
+static void renderLoop(void *arg) {
+    Renderer *renderer = (Renderer *)arg;
+    glfwMakeContextCurrent(renderer->window);
+    CameraHandoff *handoff = &renderer->simulation->handoff;
+    Trails *trails = renderer->simulation->trails;
+    SkyTiles *skyTiles = &renderer->skyTiles;
+    CubeCache *cubeCache = &renderer->cubeCache;
+    Progressive *progressive = &renderer->progressive;
+    Reprojection *reprojection = &renderer->reprojection;
+    DynamicResolution *resolution = &renderer->resolution;
+    StreamBuffer *ssbo = &renderer->ssbo;
+    ShaderData shaderData = renderer->shaderData;
+    int width = renderer->width;
+    int height = renderer->height;
+
+    const float f = 1.0f / shaderData.halfHeight;
+    const float aspect = (float)width / height;
+
+    DirectoryWatch shaderWatch = watchDirectory("shaders");
+
+    while (!atomicFetchAdd(&renderer->quit, 0)) {
+        ShaderData lastShaderData = shaderData;
+        CameraState camera;
+        takeCamera(handoff, &camera);
+        applyCamera(&shaderData, &camera);
+        bool trailsChanged = uploadTrails(trails);
+
+        // Pick how this frame is rendered before uploading shaderData.
+        bool eyeFixed = equalV3(shaderData.eye, lastShaderData.eye) && shaderData.integrator == lastShaderData.integrator;
+        bool viewChanged = !sameView(&shaderData, &lastShaderData);
+        bool trace = true;
+        bool useCubeCache = false;
+        bool useReprojection = false;
+        // Only progressive samples are accumulated by the resolve pass.
+        shaderData.sampleIndex = -1;
+        // New sky tiles change the colors but not the results, a still view is refined again.
+        bool skyTilesChanged = kernelConstants.skyTiles && updateSkyTiles(skyTiles);
+        // Edited kernels are rebuilt in the background and swapped in, what the old ones traced is stale.
+        if (directoryChanged(&shaderWatch, ".glsl")) {
+            reloadPrograms();
+        }
+        bool kernelsChanged = swapReloadedPrograms();
+        if (kernelsChanged) {
+            cubeCache->valid = false;
+            reprojection->valid = false;
+        }
+        if (viewChanged || skyTilesChanged || kernelsChanged) {
+            restartProgressive(progressive);
+        }
+        float scale = beginRenderTiming(resolution, viewChanged);
+        int nx = (int)(scale * width);
+        int ny = (int)(scale * height);
+        shaderData.nx = (float)nx;
+        shaderData.ny = (float)ny;
+        if (progressive->maxSamples > 0 && !viewChanged) {
+            trace = nextProgressiveSample(progressive, &shaderData);
+        } else if (cubeCache->size > 0 && eyeFixed && viewChanged) {
+            // Only the view direction changed since the last frame, reuse the cached geodesics. A
+            // still view is traced, the cache is coarser than the screen and filtered across edges.
+            useCubeCache = true;
+        } else if (progressive->maxSamples > 0) {
+            progressivePreview(progressive, &shaderData);
+        } else if (reprojection->threshold > 0.0f) {
+            // Reuse what is still accurate enough of the last reprojected frame.
+            useReprojection = true;
+        }
+
+        ShaderData *frameData = beginStreamWrite(ssbo);
+        *frameData = shaderData;
+        endStreamWrite(ssbo);
+        glBindBufferRange(GL_SHADER_STORAGE_BUFFER, SSBO_LOCATION, ssbo->id, streamOffset(ssbo), sizeof(shaderData));
+
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        if (useCubeCache) {
+            renderFromCubeCache(cubeCache, &shaderData, nx, ny);
+            resolveResults(renderer->resultsTextureId, nx, ny);
+        } else if (useReprojection) {
+            renderReprojected(reprojection, &shaderData);
+            resolveResults(reprojectedResults(reprojection), nx, ny);
+        } else if (trace) {
+            int previewScale = shaderData.previewScale;
+            glUseProgram(rayTracerProgram(shaderData.integrator));
+            glDispatchCompute(((nx + previewScale - 1) / previewScale + 31) / 32, ((ny + previewScale - 1) / previewScale + 31) / 32, 1);
+            resolveResults(renderer->resultsTextureId, nx, ny);
+        }
+        if (kernelConstants.skyTiles) {
+            readSkyTileFeedback(skyTiles);
+        }
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        glBlitFramebuffer(0, 0, nx, ny, 0, 0, width, height, GL_COLOR_BUFFER_BIT, scale < 1.0f ? GL_LINEAR : GL_NEAREST);
+        endRenderTiming(resolution);
+
+        float trailViewProjection[16];
+        viewProjection(f, aspect, camera.eye, camera.u, camera.v, camera.w, trailViewProjection);
+        drawTrails(trails, trailViewProjection);
+        endStreamFrame(ssbo);
+
+        glfwSwapBuffers(renderer->window);
+
+        bool skyFinal = !kernelConstants.skyTiles || !skyTilesLoading(skyTiles);
+        if (progressiveConverged(progressive) && !trailsChanged && skyFinal) {
+            // Nothing changes until the simulation hands something over.
+            for (int i=0; i<100 && !cameraPublished(handoff) && !trailsQueued(trails) && !atomicFetchAdd(&renderer->quit, 0); i++) {
+                sleepMilliseconds(1);
+            }
+        }
+    }
+    glfwMakeContextCurrent(NULL);
+}
 
-    shaderData->eye = cP;
-    shaderData->u = fromV3(u);
-    shaderData->v = fromV3(v);
-    shaderData->w = fromV3(w);
+static void usage() {
+    printf("usage: main [-w width] [-h height] [-trail length] [-bundle photons,particles] [-spread degrees] [-speed v] [-trailrate steps]\n"
+           "            [-step size] [-iter n] [-disc inner,outer] [-skyradius r] [-sky path] [-skyformat rgba8|srgb|bptc]\n"
+           "            [-skycube faceSize] [-skytiles atlasTiles] [-cubemap faceSize] [-progressive maxSamples] [-preview scale] [-reproject threshold] [-fps target]\n");
+    exit(-1);
 }
 
-void main() {
+int main(int argc, char **argv) {
+    int width = 1920;
+    int height = 1024;
+    // Points per trail, the bundle fired from the eye is numPhotons photons and numParticles massive
+    // particles in a cone of trailSpread degrees, advancing trailRate steps per second.
+    int trailLen = 1000;
+    int numPhotons = 1;
+    int numParticles = 0;
+    float trailSpread = 5.0f;
+    float particleSpeed = 0.3f;
+    float trailRate = 60.0f;
+    // Face size of the cube map cache used while only the view direction changes, 0 disables it.
+    // Off by default, a face as fine as the screen takes height / tan(fovy / 2) texels, 2470 at 1024
+    // rows, and a coarser one blurs the shadow and disc edges while turning.
+    int cubeCacheSize = 0;
+    // Samples per pixel accumulated while the view doesn't change, 0 disables progressive rendering.
+    int maxSamples = 0;
+    int previewScale = 4;
+    // Error estimate in radians under which pixels of the last frame are reused, 0 disables reprojection.
+    float reprojectionThreshold = 0.002f;
+    // Frame rate kept while the view changes by lowering the render resolution, 0 disables it.
+    float targetFps = 0.0f;
+    SkyFormat skyFormat = SKY_RGBA8;
+    // Face size of the sky cube map, -1 for a quarter of the sky map width, 0 samples the
+    // equirectangular map directly like the CPU renderer.
+    int skyCubeSize = -1;
+    char *skyPath = "data/sky8k.jpg";
+    // Side of the atlas of the virtual-texture sky in tiles, 0 loads the whole sky map.
+    int skyAtlasTiles = 0;
+    for (int i=1; i<argc; i++) {
+        if (i + 1 >= argc) {
+            usage();
+        }
+        char *arg = argv[i];
+        char *value = argv[++i];
+        if (!strcmp(arg, "-w")) {
+            width = atoi(value);
+        } else if (!strcmp(arg, "-h")) {
+            height = atoi(value);
+        } else if (!strcmp(arg, "-trail")) {
+            trailLen = atoi(value);
+        } else if (!strcmp(arg, "-bundle")) {
+            if (sscanf(value, "%d,%d", &numPhotons, &numParticles) != 2) {
+                usage();
+            }
+        } else if (!strcmp(arg, "-spread")) {
+            trailSpread = (float)atof(value);
+        } else if (!strcmp(arg, "-speed")) {
+            particleSpeed = (float)atof(value);
+        } else if (!strcmp(arg, "-trailrate")) {
+            trailRate = (float)atof(value);
+        } else if (!strcmp(arg, "-step")) {
+            kernelConstants.step = (float)atof(value);
+        } else if (!strcmp(arg, "-iter")) {
+            kernelConstants.numIter = atoi(value);
+        } else if (!strcmp(arg, "-disc")) {
+            if (sscanf(value, "%f,%f", &kernelConstants.dInnerR, &kernelConstants.dOuterR) != 2) {
+                usage();
+            }
+        } else if (!strcmp(arg, "-skyradius")) {
+            kernelConstants.skyR = (float)atof(value);
+        } else if (!strcmp(arg, "-skyformat")) {
+            if (!parseSkyFormat(value, &skyFormat)) {
+                usage();
+            }
+        } else if (!strcmp(arg, "-skycube")) {
+            skyCubeSize = atoi(value);
+        } else if (!strcmp(arg, "-sky")) {
+            skyPath = value;
+        } else if (!strcmp(arg, "-skytiles")) {
+            skyAtlasTiles = atoi(value);
+        } else if (!strcmp(arg, "-cubemap")) {
+            cubeCacheSize = atoi(value);
+        } else if (!strcmp(arg, "-progressive")) {
+            maxSamples = atoi(value);
+        } else if (!strcmp(arg, "-preview")) {
+            previewScale = atoi(value);
+        } else if (!strcmp(arg, "-reproject")) {
+            reprojectionThreshold = (float)atof(value);
+        } else if (!strcmp(arg, "-fps")) {
+            targetFps = (float)atof(value);
+        } else {
+            usage();
+        }
+    }
+    if (width <= 0 || height <= 0 || trailLen <= 0 || numPhotons < 0 || numParticles < 0 || numPhotons + numParticles <= 0) {
+        usage();
+    }
+    kernelConstants.skySrgb = skyFormat == SKY_SRGB8;
+    kernelConstants.skyTiles = skyAtlasTiles > 0;
+    kernelConstants.skyCube = skyCubeSize != 0 && !kernelConstants.skyTiles;
+
+    // The sky map is read, or its tiles opened, while the window is created and the kernels compiled.
+    SkySource skySource = newSkySource(skyPath, skyFormat, skyCubeSize);
+    SkyTileFile skyTileFile = {.sourcePath = skyPath};
+    Thread skyThread;
+    if (kernelConstants.skyTiles) {
+        startThread(&skyThread, openSkyTileFile, &skyTileFile);
+    } else {
+        startThread(&skyThread, readSkySource, &skySource);
+    }
+
     if (!glfwInit()) {
         printf("Could not init GLFW\n");
         exit(-1);
@@ -125,7 +371,7 @@ void main() {
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-    GLFWwindow *window = glfwCreateWindow(NX, NY, "Sailing", NULL, NULL);
+    GLFWwindow *window = glfwCreateWindow(width, height, "Sailing", NULL, NULL);
     if (!window) {
         printf("Could not init GLFW window\n");
         exit(-1);
@@ -135,6 +381,7 @@ void main() {
         printf("Could not init OpenGL context\n");
         exit(-1);
     }
+    loadBufferStorage((GLADloadproc) glfwGetProcAddress);
 
     glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
     if (glfwRawMouseMotionSupported()) {
@@ -151,38 +398,61 @@ void main() {
     glActiveTexture(GL_TEXTURE0 + outputTextureUnit);
     glBindTexture(GL_TEXTURE_2D, outputTextureId);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, NX, NY, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
     glBindImageTexture(outputTextureUnit, outputTextureId, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
-    int xSkyMap, ySkyMap, nSkyMap;
-    stbi_set_flip_vertically_on_load(true);
-    unsigned char *skyMap = stbi_load("data/sky8k.jpg", &xSkyMap, &ySkyMap, &nSkyMap, STBI_rgb_alpha);
-
-    // Create and bind a texture from the skymap image
-    GLuint skyMapTextureUnit = 1;
-    GLuint skyMapTextureId;
-    glGenTextures(1, &skyMapTextureId);
-    glActiveTexture(GL_TEXTURE0 + skyMapTextureUnit);
-    glBindTexture(GL_TEXTURE_2D, skyMapTextureId);
-    // Todo: try to use skyMapTextureId samplers instead of the raw image to remove glistening?
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, xSkyMap, ySkyMap, 0, GL_RGBA, GL_UNSIGNED_BYTE, skyMap);
-    glBindImageTexture(skyMapTextureUnit, skyMapTextureId, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    // The renderers write results, resolveResults turns them into colors.
+    GLuint resultsTextureId;
+    glGenTextures(1, &resultsTextureId);
+    glActiveTexture(GL_TEXTURE0 + RESOLVE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, resultsTextureId);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, width, height);
+    glBindImageTexture(RESULTS_UNIT, resultsTextureId, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+
+    // Compile what the first frames use, the rest is compiled on first use.
+    rayTracerProgram(INTEGRATOR_VERLET);
+    resolveProgram();
+    if (kernelConstants.skyCube) {
+        skyCubeProgram();
+    }
+    if (cubeCacheSize > 0) {
+        cubeCacheProgram(INTEGRATOR_VERLET);
+        cubeResampleProgram(INTEGRATOR_VERLET);
+    }
+    if (reprojectionThreshold > 0.0f) {
+        reprojectProgram(INTEGRATOR_VERLET);
+        retraceProgram(INTEGRATOR_VERLET);
+    }
 
-    stbi_image_free(skyMap);
+    int xSkyMap, ySkyMap;
+    joinThread(&skyThread);
+    // The sky tile loader keeps pointers into renderer.skyTiles, renderer stays here.
+    Renderer renderer = {0};
+    if (kernelConstants.skyTiles) {
+        renderer.skyTiles = initSkyTiles(&skyTileFile, skyAtlasTiles, skyFormat);
+        startSkyTileLoader(&renderer.skyTiles);
+        xSkyMap = skyTileFile.header.width;
+        ySkyMap = skyTileFile.header.height;
+    } else {
+        uploadSky(&skySource, &xSkyMap, &ySkyMap);
+    }
 
-    GLuint computeShaderId = shaderFromSource("rayTracer", GL_COMPUTE_SHADER, "shaders/compute.glsl");
-    GLuint computeProgramId = shaderProgramFromShader(computeShaderId);
+    renderer.window = window;
+    renderer.width = width;
+    renderer.height = height;
+    renderer.resultsTextureId = resultsTextureId;
+    renderer.cubeCache = initCubeCache(cubeCacheSize);
+    renderer.progressive = initProgressive(maxSamples, previewScale, width, height);
+    renderer.reprojection = initReprojection(reprojectionThreshold, width, height);
+    renderer.resolution = initDynamicResolution(targetFps);
 
-    ShaderData shaderData = initShaderData(NX, NY, xSkyMap, ySkyMap);
+    renderer.shaderData = initShaderData(width, height, xSkyMap, ySkyMap);
 
-    // Create and bind the SSBO
-    GLuint ssboLocation = 0;
-    GLuint ssboId;
-    glGenBuffers(1, &ssboId);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssboId);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(shaderData), &shaderData, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ssboLocation, ssboId);
+    // shaderData is streamed to the SSBO, each frame binds the range it wrote.
+    GLint ssboAlignment;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &ssboAlignment);
+    renderer.ssbo = initStreamBuffer(GL_SHADER_STORAGE_BUFFER, sizeof(ShaderData), ssboAlignment);
 
     GLuint fboId;
     glGenFramebuffers(1, &fboId);
@@ -192,71 +462,42 @@ void main() {
     GLuint vaoId;
     glGenVertexArrays(1, &vaoId);
     glBindVertexArray(vaoId);
-    v3 *trailPos = calloc(TRAIL_LEN*sizeof(v3), sizeof(v3));
-    v3 *trailView = calloc(TRAIL_LEN*sizeof(v3), sizeof(v3));
-
-    // Find the correct first point depending on the camera.
-    v3 laserP = cP;
-    v3 laserVelocity = cFront;
-    v3 laserCrossed = crossV3(laserP, laserVelocity);
-    float laserH2 = dotV3(laserCrossed, laserCrossed);
-    float sqrNorm = dotV3(laserP, laserP);
-    float coef = 1.0f - 1.0f / sqrtf(sqrNorm);
-    trailPos[0] = laserP;
-    int trailNumPoints = 1;
-
-    const float f = 1.0f / shaderData.halfHeight;
-    const float zFar = 100.0f, zNear = 0.1f;
-    const float aspect = (float)NX / NY;
-    v3 laserPView = lookAt(cP, u, v, w, laserP);
-    trailView[0] = perspective(f, aspect, zNear, zFar, laserPView);
-
-    GLuint vboId;
-    glGenBuffers(1, &vboId);
-    glBindBuffer(GL_ARRAY_BUFFER, vboId);
-    glBufferData(GL_ARRAY_BUFFER, 3*TRAIL_LEN*sizeof(float), trailView, GL_STREAM_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void *)0);
-
-    GLuint vsShaderId = shaderFromSource("laserVs", GL_VERTEX_SHADER, "shaders/laser.vs");
-    GLuint fsShaderId = shaderFromSource("laserFs", GL_FRAGMENT_SHADER, "shaders/laser.fs");
-    GLuint laserProgramId = shaderProgramFromShaders(vsShaderId, fsShaderId);
-
-    while(!glfwWindowShouldClose(window)) {
-        actOnInput(window, &shaderData);
-
-        if (sqrNorm > 2.6f * 2.6f && sqrNorm < skyR2 && trailNumPoints < TRAIL_LEN) {
-            coef = 1.0f - 1.0f / sqrtf(sqrNorm);
-            float step = 0.1f * coef;
-            laserP = addV3(laserP, mulV3(step, laserVelocity));
-            sqrNorm = dotV3(laserP, laserP);
-            v3 laserAccel = mulV3(potentialCoef * laserH2 / powf(sqrNorm, 2.5), laserP);
-            laserVelocity = addV3(laserVelocity, mulV3(step, laserAccel));
-            trailPos[trailNumPoints++] = laserP;
-        }
 
-        for (int i=0; i<trailNumPoints; i++) {
-            laserPView = lookAt(cP, u, v, w, trailPos[i]);
-            trailView[i] = perspective(f, aspect, zNear, zFar, laserPView);
+    // The bundle is fired from the camera at startup and again with F.
+    Trails trails = initTrails(numPhotons, numParticles, trailLen, trailSpread, particleSpeed, trailRate / SIM_RATE, kernelConstants.dInnerR, kernelConstants.skyR);
+    launchTrails(&trails, cP, cFront, cRight, cUp, 0);
+
+    Simulation simulation = {0};
+    simulation.window = window;
+    simulation.trails = &trails;
+    CameraState camera = {cP, u, v, w, renderer.shaderData.integrator};
+    simulation.camera = camera;
+    initCameraHandoff(&simulation.handoff, &camera);
+    renderer.simulation = &simulation;
+
+    // The render thread takes the context over.
+    glfwMakeContextCurrent(NULL);
+    Thread renderThread;
+    startThread(&renderThread, renderLoop, &renderer);
+
+    double nextTick = glfwGetTime();
+    while (!glfwWindowShouldClose(window)) {
+        double now = glfwGetTime();
+        if (now < nextTick) {
+            glfwWaitEventsTimeout(nextTick - now);
+            continue;
         }
-
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(shaderData), &shaderData);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float)*3*trailNumPoints, trailView);
-
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        glUseProgram(computeProgramId);
-        glDispatchCompute(NX/32, NY/32, 1);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-        glBlitFramebuffer(0, 0, NX, NY, 0, 0, NX, NY, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-        
-        glUseProgram(laserProgramId);
-        glDrawArrays(GL_LINE_STRIP, 0, trailNumPoints);
-
-        glfwSwapBuffers(window);
-
         glfwPollEvents();
+        simulate(&simulation);
+        // After a stall the simulation goes on from now instead of catching up.
+        nextTick = now - nextTick > 0.25 ? now : nextTick + 1.0 / SIM_RATE;
     }
 
+    atomicFetchAdd(&renderer.quit, 1);
+    joinThread(&renderThread);
+    if (kernelConstants.skyTiles) {
+        stopSkyTileLoader(&renderer.skyTiles);
+    }
     glfwTerminate();
+    return 0;
 }
@@ -59,28 +59,23 @@ static inline v3 normalizeV3(v3 v) {
     return result;
 }
 
-static inline v3 lookAt(v3 cP, v3 u, v3 v, v3 w, v3 p) {
-    v3 result;
-    result.x = u.x * p.x + u.y * p.y + u.z * p.z - dotV3(u, cP);
-    result.y = v.x * p.x + v.y * p.y + v.z * p.z - dotV3(v, cP);
-    result.z = w.x * p.x + w.y * p.y + w.z * p.z - dotV3(w, cP);
-    return result;
-}
-
-static inline v3 perspective(float f, float aspect, float zNear, float zFar, v3 p) {
-    v3 result;
-    // TODO: not sure if this is correct.
-    if (fabsf(p.z) < TOLERANCE) {
-        result.x = (f / aspect) * p.x;
-        result.y = f * p.y;
-        result.z = 1.0f;
-    } else {
-        result.x = (f / aspect) * p.x / (-p.z);
-        result.y = f * p.y / (-p.z);
-        //result.z = (zFar+zNear)/(zNear-zFar) * p.z + (2*zFar*zNear)/(zNear-zFar);
-        result.z = 1.0f;
+// Column major for glUniformMatrix4fv: the view from cP along -w, u and v being the right and up
+// axes, then the perspective projection with focal length f. The depth is left at 0, what is behind
+// the eye is clipped.
+static void viewProjection(float f, float aspect, v3 cP, v3 u, v3 v, v3 w, float m[16]) {
+    v3 rows[2] = {mulV3(f / aspect, u), mulV3(f, v)};
+    for (int i=0; i<2; i++) {
+        m[i] = rows[i].x;
+        m[4 + i] = rows[i].y;
+        m[8 + i] = rows[i].z;
+        m[12 + i] = -dotV3(rows[i], cP);
+        m[4*i + 2] = 0.0f;
+        m[4*(i + 2) + 2] = 0.0f;
     }
-    return result;
+    m[3] = -w.x;
+    m[7] = -w.y;
+    m[11] = -w.z;
+    m[15] = dotV3(w, cP);
 }
 
 typedef struct {
@@ -96,3 +91,26 @@ static inline v4 fromV3(v3 v) {
     return result;
 }
 
+
+static inline v4 newV4(float x, float y, float z, float w) {
+    v4 result;
+    result.x = x;
+    result.y = y;
+    result.z = z;
+    result.w = w;
+    return result;
+}
+
+// Same as GLSL mix(x, y, a).
+static inline v4 mixV4(v4 x, v4 y, float a) {
+    v4 result;
+    result.x = x.x + (y.x - x.x) * a;
+    result.y = x.y + (y.y - x.y) * a;
+    result.z = x.z + (y.z - x.z) * a;
+    result.w = x.w + (y.w - x.w) * a;
+    return result;
+}
+
+static inline bool equalV3(v3 u, v3 v) {
+    return u.x == v.x && u.y == v.y && u.z == v.z;
+}
@@ -18,29 +18,69 @@ static void ck() {
     exit(-1);
 }
 
-static GLuint shaderFromSource(char* name, GLenum shaderType, char* path) {
+#define MAX_SHADER_SOURCES 4
+#define MAX_DEFINES_LEN 512
+
+// Starts compiling the concatenation of preamble, which can be NULL, and the files in paths. The
+// #version line comes first, in the preamble when there is one. The files are handed to GL as
+// mapped. Returns 0 if one of them can't be opened.
+static GLuint compileShaderSources(GLenum shaderType, char* preamble, char** paths, int numPaths) {
+    const char* sources[MAX_SHADER_SOURCES + 1];
+    int lens[MAX_SHADER_SOURCES + 1];
+    MappedFile files[MAX_SHADER_SOURCES];
+    int numSources = 0;
+    if (preamble) {
+        sources[numSources] = preamble;
+        lens[numSources++] = (int)strlen(preamble);
+    }
+    for (int i=0; i<numPaths; i++) {
+        if (!mapFile(paths[i], &files[i])) {
+            printf("Could not open shader %s\n", paths[i]);
+            for (int j=0; j<i; j++) {
+                unmapFile(&files[j]);
+            }
+            return 0;
+        }
+        sources[numSources] = files[i].data ? (const char*)files[i].data : "";
+        lens[numSources++] = (int)files[i].size;
+    }
     GLuint shaderId = glCreateShader(shaderType);
-    char source[10240];
-    int len = 10240;
-    getFileContents(path, source, &len);
-    const GLchar* sourceAddr = &source[0];
-    glShaderSource(shaderId, 1, &sourceAddr, &len);
+    glShaderSource(shaderId, numSources, sources, lens);
     glCompileShader(shaderId);
+    for (int i=0; i<numPaths; i++) {
+        unmapFile(&files[i]);
+    }
+    return shaderId;
+}
 
+// Prints the log of a shader that failed to compile.
+static bool shaderCompiled(char* name, GLuint shaderId) {
     GLint compileStatus;
     glGetShaderiv(shaderId, GL_COMPILE_STATUS, &compileStatus);
     if (compileStatus != GL_TRUE) {
         char infoLog[512];
         glGetShaderInfoLog(shaderId, 512, NULL, infoLog);
         printf("Shader %s compilation failed: %s", name, infoLog);
-        exit(-1);
+        return false;
     }
+    return true;
+}
 
+static GLuint shaderFromSources(char* name, GLenum shaderType, char* preamble, char** paths, int numPaths) {
+    GLuint shaderId = compileShaderSources(shaderType, preamble, paths, numPaths);
+    if (!shaderId || !shaderCompiled(name, shaderId)) {
+        exit(-1);
+    }
     return shaderId;
 }
 
+static GLuint shaderFromSource(char* name, GLenum shaderType, char* path) {
+    return shaderFromSources(name, shaderType, NULL, &path, 1);
+}
+
 static GLuint shaderProgramFromShader(GLuint shaderId) {
     GLuint programId = glCreateProgram();
+    glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glAttachShader(programId, shaderId);
     glLinkProgram(programId);
     GLint programStatus;
@@ -57,26 +97,295 @@ static GLuint shaderProgramFromShader(GLuint shaderId) {
 
 static GLuint shaderProgramFromShaders(GLuint shader1, GLuint shader2) {
     GLuint programId = glCreateProgram();
-    GLuint shaders[2];
-    shaders[0] = shader1;
-    shaders[1] = shader2;
-    for (int i=0; i<2; i++) {
-        GLuint shaderId = shaders[i];
-        glAttachShader(programId, shaderId);
-        glLinkProgram(programId);
+    glAttachShader(programId, shader1);
+    glAttachShader(programId, shader2);
+    glLinkProgram(programId);
+    GLint programStatus;
+    glGetProgramiv(programId, GL_LINK_STATUS, &programStatus);
+    if (programStatus != 1) {
+        char infoLog[512];
+        glGetProgramInfoLog(programId, 512, NULL, infoLog);
+        printf("Shader program link failed: %s\n", infoLog);
+        exit(-1);
+    }
+    glDetachShader(programId, shader1);
+    glDetachShader(programId, shader2);
+    return programId;
+}
+
+// Linked programs are kept in PROGRAM_CACHE_DIR, named after a hash of everything they are built
+// from and of the driver, and loaded with glProgramBinary on later runs. A binary the driver
+// rejects is compiled again.
+#define PROGRAM_CACHE_DIR "shaders/cache"
+#define PROGRAM_CACHE_MAGIC 0x4d475250
+
+typedef struct {
+    uint32_t magic;
+    uint32_t binaryFormat;
+    uint64_t key;
+} ProgramCacheHeader;
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    // FNV-1a.
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i=0; i<size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Returns false if one of the files can't be opened.
+static bool programKey(char* preamble, char** paths, int numPaths, uint64_t* result) {
+    uint64_t key = 0xcbf29ce484222325ull;
+    GLenum driverStrings[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+    for (int i=0; i<3; i++) {
+        const char* string = (const char*)glGetString(driverStrings[i]);
+        key = hashBytes(key, string, strlen(string) + 1);
+    }
+    key = hashBytes(key, preamble, strlen(preamble) + 1);
+    for (int i=0; i<numPaths; i++) {
+        MappedFile file;
+        if (!mapFile(paths[i], &file)) {
+            printf("Could not open shader %s\n", paths[i]);
+            return false;
+        }
+        key = hashBytes(key, &file.size, sizeof(file.size));
+        key = hashBytes(key, file.data, file.size);
+        unmapFile(&file);
+    }
+    *result = key;
+    return true;
+}
+
+static void programCachePath(char* name, uint64_t key, char* path, int len) {
+    snprintf(path, len, "%s/%s-%016llx.bin", PROGRAM_CACHE_DIR, name, (unsigned long long)key);
+}
+
+// The cached program for key, 0 when there is none or the driver rejects it.
+static GLuint loadProgramBinary(char* name, uint64_t key) {
+    char path[256];
+    programCachePath(name, key, path, sizeof(path));
+    MappedFile file;
+    if (!mapFile(path, &file)) {
+        return 0;
+    }
+    ProgramCacheHeader* header = file.data;
+    GLuint programId = 0;
+    if (file.size > sizeof(ProgramCacheHeader) && header->magic == PROGRAM_CACHE_MAGIC && header->key == key) {
+        programId = glCreateProgram();
+        glProgramBinary(programId, header->binaryFormat, header + 1, (GLsizei)(file.size - sizeof(ProgramCacheHeader)));
         GLint programStatus;
         glGetProgramiv(programId, GL_LINK_STATUS, &programStatus);
-        if (programStatus != 1) {
-            char infoLog[512];
-            glGetProgramInfoLog(programId, 512, NULL, infoLog);
-            printf("Shader program link failed: %s\n", infoLog);
-            exit(-1);
+        if (programStatus != GL_TRUE) {
+            glDeleteProgram(programId);
+            programId = 0;
         }
-        glDetachShader(programId, shaderId);
     }
+    unmapFile(&file);
     return programId;
 }
 
+static void saveProgramBinary(char* name, uint64_t key, GLuint programId) {
+    GLint size = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &size);
+    if (size <= 0) {
+        return;
+    }
+    ProgramCacheHeader header = {PROGRAM_CACHE_MAGIC, 0, key};
+    void* binary = malloc(size);
+    GLenum binaryFormat;
+    glGetProgramBinary(programId, size, NULL, &binaryFormat, binary);
+    header.binaryFormat = binaryFormat;
+    char path[256], tmpPath[280];
+    programCachePath(name, key, path, sizeof(path));
+    // Written under a name of this process and renamed once complete, a crash or another viewer
+    // never leaves a truncated binary for the driver.
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, processId());
+    makeDirectory(PROGRAM_CACHE_DIR);
+    FILE* file = fopen(tmpPath, "wb");
+    if (file) {
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(binary, size, 1, file);
+        bool written = !ferror(file);
+        written = fclose(file) == 0 && written;
+        if (!written || !replaceFile(tmpPath, path)) {
+            remove(tmpPath);
+        }
+    }
+    free(binary);
+}
+
+// Constants the compute programs are built with, settable until the first kernelProgram call.
+KernelConstants kernelConstants = {NUM_ITER, STEP, D_INNER_R, D_OUTER_R, SKY_R, 0, 1, 0};
+
+#define MAX_PROGRAM_VARIANTS 32
+// GL_KHR_parallel_shader_compile, which glad wasn't generated with.
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+
+// Compute programs built so far, by entry shader and #defines. They share the geodesic kernel in
+// shaders/geodesic.glsl, which comes first in paths, and get the #defines after the #version line.
+typedef struct {
+    char* name;
+    char* paths[MAX_SHADER_SOURCES];
+    int numPaths;
+    char preamble[MAX_DEFINES_LEN + 16];
+    uint64_t key;
+    GLuint programId;
+    // Program being rebuilt from changed sources, swapped in once it links.
+    GLuint pendingId;
+    GLuint pendingShaderId;
+    uint64_t pendingKey;
+} ProgramVariant;
+
+ProgramVariant programVariants[MAX_PROGRAM_VARIANTS];
+int numProgramVariants = 0;
+
+static void buildProgramVariant(ProgramVariant* variant) {
+    if (!programKey(variant->preamble, variant->paths, variant->numPaths, &variant->key)) {
+        exit(-1);
+    }
+    variant->programId = loadProgramBinary(variant->name, variant->key);
+    if (variant->programId) {
+        return;
+    }
+    GLuint shaderId = shaderFromSources(variant->name, GL_COMPUTE_SHADER, variant->preamble, variant->paths, variant->numPaths);
+    variant->programId = shaderProgramFromShader(shaderId);
+    glDeleteShader(shaderId);
+    saveProgramBinary(variant->name, variant->key, variant->programId);
+}
+
+// The compute program of paths, the last one being the entry shader, for kernelConstants and
+// integrator. Each variant is compiled on first use and kept, so switching back to it is free.
+static GLuint kernelProgram(char* name, char** paths, int numPaths, int integrator) {
+    char defines[MAX_DEFINES_LEN];
+    kernelDefines(&kernelConstants, integrator, defines, MAX_DEFINES_LEN);
+    char preamble[MAX_DEFINES_LEN + 16];
+    snprintf(preamble, sizeof(preamble), "#version 430\n%s", defines);
+    char* path = paths[numPaths - 1];
+    for (int i=0; i<numProgramVariants; i++) {
+        ProgramVariant *variant = &programVariants[i];
+        if (!strcmp(variant->paths[variant->numPaths - 1], path) && !strcmp(variant->preamble, preamble)) {
+            return variant->programId;
+        }
+    }
+    if (numProgramVariants == MAX_PROGRAM_VARIANTS) {
+        printf("Too many program variants\n");
+        exit(-1);
+    }
+    ProgramVariant *variant = &programVariants[numProgramVariants++];
+    variant->name = name;
+    variant->paths[0] = "shaders/geodesic.glsl";
+    for (int i=0; i<numPaths; i++) {
+        variant->paths[i + 1] = paths[i];
+    }
+    variant->numPaths = numPaths + 1;
+    memcpy(variant->preamble, preamble, sizeof(preamble));
+    buildProgramVariant(variant);
+    return variant->programId;
+}
+
+static bool glExtensionSupported(const char* name) {
+    GLint numExtensions;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+    for (int i=0; i<numExtensions; i++) {
+        if (!strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parallelShaderCompile() {
+    return glExtensionSupported("GL_KHR_parallel_shader_compile") || glExtensionSupported("GL_ARB_parallel_shader_compile");
+}
+
+static void cancelReload(ProgramVariant* variant) {
+    if (variant->pendingId) {
+        glDeleteProgram(variant->pendingId);
+        glDeleteShader(variant->pendingShaderId);
+        variant->pendingId = 0;
+        variant->pendingShaderId = 0;
+    }
+}
+
+// Starts rebuilding the programs whose sources changed, in the background where the driver compiles
+// in parallel. Programs keep running until their new version links, see swapReloadedPrograms.
+static void reloadPrograms() {
+    for (int i=0; i<numProgramVariants; i++) {
+        ProgramVariant* variant = &programVariants[i];
+        uint64_t key;
+        if (!programKey(variant->preamble, variant->paths, variant->numPaths, &key) || key == variant->key ||
+            (variant->pendingId && key == variant->pendingKey)) {
+            continue;
+        }
+        cancelReload(variant);
+        variant->pendingKey = key;
+        variant->pendingId = loadProgramBinary(variant->name, key);
+        if (variant->pendingId) {
+            continue;
+        }
+        variant->pendingShaderId = compileShaderSources(GL_COMPUTE_SHADER, variant->preamble, variant->paths, variant->numPaths);
+        if (!variant->pendingShaderId) {
+            continue;
+        }
+        // With parallel compilation this returns right away, the link waits for the compile.
+        variant->pendingId = glCreateProgram();
+        glProgramParameteri(variant->pendingId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glAttachShader(variant->pendingId, variant->pendingShaderId);
+        glLinkProgram(variant->pendingId);
+    }
+}
+
+// Swaps in the programs rebuilt by reloadPrograms that are done. One that fails keeps the old
+// program and prints why. Returns true when a program changed.
+static bool swapReloadedPrograms() {
+    static int parallel = -1;
+    if (parallel < 0) {
+        parallel = parallelShaderCompile();
+    }
+    bool swapped = false;
+    for (int i=0; i<numProgramVariants; i++) {
+        ProgramVariant* variant = &programVariants[i];
+        if (!variant->pendingId) {
+            continue;
+        }
+        GLint done = GL_TRUE;
+        if (parallel) {
+            glGetProgramiv(variant->pendingId, GL_COMPLETION_STATUS_KHR, &done);
+        }
+        if (!done) {
+            continue;
+        }
+        GLint linked;
+        glGetProgramiv(variant->pendingId, GL_LINK_STATUS, &linked);
+        if (linked != GL_TRUE) {
+            if (variant->pendingShaderId && shaderCompiled(variant->name, variant->pendingShaderId)) {
+                char infoLog[512];
+                glGetProgramInfoLog(variant->pendingId, 512, NULL, infoLog);
+                printf("Shader program link failed: %s\n", infoLog);
+            }
+            printf("Keeping the last %s\n", variant->name);
+            // Not retried until the sources change again.
+            variant->key = variant->pendingKey;
+            cancelReload(variant);
+            continue;
+        }
+        if (variant->pendingShaderId) {
+            glDetachShader(variant->pendingId, variant->pendingShaderId);
+            glDeleteShader(variant->pendingShaderId);
+            variant->pendingShaderId = 0;
+            saveProgramBinary(variant->name, variant->pendingKey, variant->pendingId);
+        }
+        glDeleteProgram(variant->programId);
+        variant->programId = variant->pendingId;
+        variant->key = variant->pendingKey;
+        variant->pendingId = 0;
+        printf("Reloaded %s\n", variant->name);
+        swapped = true;
+    }
+    return swapped;
+}
+
 static void printWorkgroupInfo() {
     GLint xCnt, yCnt, zCnt;
     glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &xCnt);
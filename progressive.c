@@ -0,0 +1,73 @@
+// Progressive rendering. While the view doesn't change, every frame adds one jittered sample per
+// pixel to an accumulation image and shows the average, until maxSamples have been taken and
+// nothing is traced anymore. When the view changes, a preview tracing one pixel out of
+// previewScale x previewScale is shown instead and accumulation restarts once the camera stops.
+
+#define ACCUMULATION_UNIT 3
+
+typedef struct {
+    // 0 disables progressive rendering.
+    int maxSamples;
+    int previewScale;
+    int numSamples;
+    GLuint textureId;
+} Progressive;
+
+static Progressive initProgressive(int maxSamples, int previewScale, int nx, int ny) {
+    Progressive progressive = {0};
+    progressive.maxSamples = maxSamples;
+    progressive.previewScale = previewScale > 1 ? previewScale : 1;
+    if (maxSamples <= 0) {
+        return progressive;
+    }
+    glGenTextures(1, &progressive.textureId);
+    glActiveTexture(GL_TEXTURE0 + ACCUMULATION_UNIT);
+    glBindTexture(GL_TEXTURE_2D, progressive.textureId);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, nx, ny);
+    glBindImageTexture(ACCUMULATION_UNIT, progressive.textureId, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+    return progressive;
+}
+
+// Radical inverse of index in base, the Halton sequence.
+static float halton(int index, int base) {
+    float result = 0.0f;
+    float f = 1.0f / base;
+    while (index > 0) {
+        result += f * (index % base);
+        index /= base;
+        f /= base;
+    }
+    return result;
+}
+
+// Sets up shaderData for the next accumulated sample of an unchanged view. Returns false when
+// the image has converged and there is nothing left to trace.
+static bool nextProgressiveSample(Progressive *progressive, ShaderData *shaderData) {
+    if (progressive->numSamples >= progressive->maxSamples) {
+        return false;
+    }
+    // The first sample is at the pixel corner like the non progressive renderer.
+    shaderData->sampleIndex = progressive->numSamples;
+    shaderData->previewScale = 1;
+    shaderData->jitterX = halton(progressive->numSamples, 2);
+    shaderData->jitterY = halton(progressive->numSamples, 3);
+    progressive->numSamples++;
+    return true;
+}
+
+// Drops the accumulated samples, the view changed.
+static void restartProgressive(Progressive *progressive) {
+    progressive->numSamples = 0;
+}
+
+// Sets up shaderData for a preview of a view that just changed.
+static void progressivePreview(Progressive *progressive, ShaderData *shaderData) {
+    shaderData->sampleIndex = -1;
+    shaderData->previewScale = progressive->previewScale;
+    shaderData->jitterX = 0.0f;
+    shaderData->jitterY = 0.0f;
+}
+
+static bool progressiveConverged(Progressive *progressive) {
+    return progressive->maxSamples > 0 && progressive->numSamples >= progressive->maxSamples;
+}
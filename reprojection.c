@@ -0,0 +1,116 @@
+// Temporal reprojection for small eye motion. The results (exit direction, disc alpha) of the last
+// frame are kept in a history image with a per pixel error estimate. shaders/reproject.glsl maps
+// every new pixel to the history pixels with the same initial direction and reuses their results
+// while the estimated error stays under the threshold, listing the other pixels, which
+// shaders/retrace.glsl then traces through an indirect dispatch.
+
+#define HISTORY_UNIT 4
+#define REPROJECTION_SSBO 1
+
+// Mirrors the reprojection block of shaders/reprojection.glsl, followed by the retrace list.
+typedef struct {
+    GLuint numGroupsX;
+    GLuint numGroupsY;
+    GLuint numGroupsZ;
+    GLuint numRetraced;
+    v4 historyEye;
+    v4 historyU;
+    v4 historyV;
+    v4 historyW;
+    float threshold;
+    int historyValid;
+    float historyNx;
+    float historyNy;
+} ReprojectionHeader;
+
+typedef struct {
+    // 0 disables reprojection.
+    float threshold;
+    // Result and error images, current is written this frame and the other one is the history.
+    GLuint resultIds[2];
+    GLuint errorIds[2];
+    int current;
+    GLuint bufferId;
+    bool valid;
+    int integrator;
+    float tolerance;
+    ShaderData history;
+} Reprojection;
+
+// The images are nx by ny, the largest resolution rendered.
+static Reprojection initReprojection(float threshold, int nx, int ny) {
+    Reprojection reprojection = {0};
+    reprojection.threshold = threshold;
+    if (threshold <= 0.0f) {
+        return reprojection;
+    }
+    glGenTextures(2, reprojection.resultIds);
+    glGenTextures(2, reprojection.errorIds);
+    for (int i=0; i<2; i++) {
+        glBindTexture(GL_TEXTURE_2D, reprojection.resultIds[i]);
+        // Read with texelFetch by resolve.glsl.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, nx, ny);
+        glBindTexture(GL_TEXTURE_2D, reprojection.errorIds[i]);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_R32F, nx, ny);
+    }
+
+    glGenBuffers(1, &reprojection.bufferId);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, reprojection.bufferId);
+    glBufferData(GL_DISPATCH_INDIRECT_BUFFER, sizeof(ReprojectionHeader) + (size_t)nx * ny * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, REPROJECTION_SSBO, reprojection.bufferId);
+    return reprojection;
+}
+
+static GLuint reprojectProgram(int integrator) {
+    char *paths[2] = {"shaders/reprojection.glsl", "shaders/reproject.glsl"};
+    return kernelProgram("reproject", paths, 2, integrator);
+}
+
+static GLuint retraceProgram(int integrator) {
+    char *paths[2] = {"shaders/reprojection.glsl", "shaders/retrace.glsl"};
+    return kernelProgram("retrace", paths, 2, integrator);
+}
+
+// Renders the output image reusing the last reprojected frame where possible, which can have
+// another resolution. The ShaderData SSBO must be up to date.
+static void renderReprojected(Reprojection *reprojection, ShaderData *shaderData) {
+    ReprojectionHeader header = {0};
+    header.numGroupsY = 1;
+    header.numGroupsZ = 1;
+    header.historyEye = fromV3(reprojection->history.eye);
+    header.historyU = reprojection->history.u;
+    header.historyV = reprojection->history.v;
+    header.historyW = reprojection->history.w;
+    header.threshold = reprojection->threshold;
+    header.historyNx = reprojection->history.nx;
+    header.historyNy = reprojection->history.ny;
+    header.historyValid = reprojection->valid && reprojection->integrator == shaderData->integrator &&
+        reprojection->tolerance == shaderData->tolerance;
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, reprojection->bufferId);
+    glBufferSubData(GL_DISPATCH_INDIRECT_BUFFER, 0, sizeof(header), &header);
+
+    int current = reprojection->current;
+    glBindImageTexture(HISTORY_UNIT, reprojection->resultIds[1 - current], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+    glBindImageTexture(HISTORY_UNIT + 1, reprojection->errorIds[1 - current], 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(HISTORY_UNIT + 2, reprojection->resultIds[current], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(HISTORY_UNIT + 3, reprojection->errorIds[current], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+    glUseProgram(reprojectProgram(shaderData->integrator));
+    glDispatchCompute(((int)shaderData->nx + 31) / 32, ((int)shaderData->ny + 31) / 32, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+    glUseProgram(retraceProgram(shaderData->integrator));
+    glDispatchComputeIndirect(0);
+
+    reprojection->current = 1 - current;
+    reprojection->valid = true;
+    reprojection->integrator = shaderData->integrator;
+    reprojection->tolerance = shaderData->tolerance;
+    reprojection->history = *shaderData;
+}
+
+
+// Results of the last renderReprojected, to be resolved.
+static GLuint reprojectedResults(Reprojection *reprojection) {
+    return reprojection->resultIds[1 - reprojection->current];
+}
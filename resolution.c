@@ -0,0 +1,68 @@
+// Dynamic resolution. While the view changes, frames are rendered at a fraction of the window
+// size chosen to keep their render time under a budget, and upscaled when blitted to the window.
+// The render time is measured both with timer queries and on the CPU, as software rasterizers
+// like llvmpipe run the dispatches synchronously and report no GPU time. Still views are
+// rendered at full resolution.
+
+#define MIN_RENDER_SCALE 0.25f
+// Render scales are multiples of this, so that small changes of the render time don't resize.
+#define RENDER_SCALE_STEP (1.0f / 32.0f)
+
+typedef struct {
+    // Seconds, 0 disables dynamic resolution.
+    float budget;
+    // Scale of the frames where the view changes.
+    float scale;
+    // Timings of the last two frames, the timer query of a frame is read during the next one.
+    GLuint queryIds[2];
+    double cpuTimes[2];
+    bool scaled[2];
+    int frame;
+    double cpuStart;
+} DynamicResolution;
+
+static DynamicResolution initDynamicResolution(float targetFps) {
+    DynamicResolution resolution = {0};
+    resolution.budget = targetFps > 0.0f ? 1.0f / targetFps : 0.0f;
+    resolution.scale = 1.0f;
+    glGenQueries(2, resolution.queryIds);
+    return resolution;
+}
+
+// Starts timing a frame and returns its render scale.
+static float beginRenderTiming(DynamicResolution *resolution, bool viewChanged) {
+    int slot = resolution->frame % 2;
+    resolution->scaled[slot] = resolution->budget > 0.0f && viewChanged;
+    glBeginQuery(GL_TIME_ELAPSED, resolution->queryIds[slot]);
+    resolution->cpuStart = glfwGetTime();
+    return resolution->scaled[slot] ? resolution->scale : 1.0f;
+}
+
+// Ends timing the frame and adapts the scale to the render time of the previous one.
+static void endRenderTiming(DynamicResolution *resolution) {
+    int slot = resolution->frame % 2;
+    glEndQuery(GL_TIME_ELAPSED);
+    resolution->cpuTimes[slot] = glfwGetTime() - resolution->cpuStart;
+    resolution->frame++;
+    if (resolution->frame < 2 || !resolution->scaled[1 - slot]) {
+        return;
+    }
+
+    GLuint available;
+    glGetQueryObjectuiv(resolution->queryIds[1 - slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+        return;
+    }
+    GLuint64 gpuTime;
+    glGetQueryObjectui64v(resolution->queryIds[1 - slot], GL_QUERY_RESULT, &gpuTime);
+    double renderTime = fmax(gpuTime * 1e-9, resolution->cpuTimes[1 - slot]);
+    float scale = resolution->scale;
+    if (renderTime > resolution->budget) {
+        // The cost goes with the number of pixels.
+        scale *= fmaxf(sqrtf((float)(resolution->budget / renderTime)), 0.75f);
+        scale = floorf(scale / RENDER_SCALE_STEP) * RENDER_SCALE_STEP;
+    } else if (renderTime < 0.7 * resolution->budget) {
+        scale += RENDER_SCALE_STEP;
+    }
+    resolution->scale = fminf(fmaxf(scale, MIN_RENDER_SCALE), 1.0f);
+}
@@ -0,0 +1,14 @@
+// Traces every texel of a direction-indexed cube map of results from the eye, one face per z.
+layout(local_size_x = 32, local_size_y = 32) in;
+layout(rgba32f, binding = 2) uniform writeonly imageCube cache;
+
+void main() {
+    ivec3 texel = ivec3(gl_GlobalInvocationID);
+    int size = imageSize(cache).x;
+    if (texel.x >= size || texel.y >= size) {
+        return;
+    }
+    vec2 st = (vec2(texel.xy) + 0.5) / float(size);
+    vec4 result = trace(eyeAndHalfHeight.xyz, normalize(cubeDirection(gl_GlobalInvocationID.z, st)));
+    imageStore(cache, texel, result);
+}
@@ -0,0 +1,448 @@
+// The #version line and the #defines of NUM_ITER, STEP, D_INNER_R, D_OUTER_R, SKY_R, SKY_SRGB,
+// SKY_CUBE, SKY_TILES and INTEGRATOR are prepended by the host, see kernelDefines in geodesic.c.
+// The equirectangular map, or the atlas of the resident tiles with SKY_TILES.
+layout(binding = 1) uniform sampler2D skyMap;
+// The sky map converted by skycube.glsl, see buildSkyCube in sky.c.
+layout(binding = 4) uniform samplerCube skyCube;
+layout(std430, binding = 0) readonly buffer data
+{
+    float nx;
+    float ny;
+    float fxSkyMap;
+    float fySkyMap;
+    vec4 eyeAndHalfHeight;
+    vec4 u;
+    vec4 v;
+    vec4 w;
+    // Compiled in as INTEGRATOR, see trace.
+    int integrator;
+    float tolerance;
+    int sampleIndex;
+    int previewScale;
+    vec2 jitter;
+};
+
+#if SKY_TILES
+// See skytiles.c.
+const int SKY_TILE_SIZE = 128;
+const int SKY_TILE_CONTENT = SKY_TILE_SIZE - 2;
+const int MAX_SKY_LEVELS = 24;
+const uint MAX_TILE_REQUESTS = 4096u;
+
+layout(std430, binding = 2) readonly buffer skyPages
+{
+    // width, height, tilesX and firstTile of each level.
+    ivec4 skyLevels[MAX_SKY_LEVELS];
+    int numSkyLevels;
+    int skyAtlasTiles;
+    // Slot + 1 of each tile in the atlas, 0 when it isn't resident.
+    uint skyPageTable[];
+};
+
+layout(std430, binding = 3) buffer skyFeedback
+{
+    uint numTileRequests;
+    uint tileRequests[MAX_TILE_REQUESTS];
+    // Set once a tile is in tileRequests.
+    uint tileRequested[];
+};
+#endif
+
+const float PI = 3.1415926535897932384626433832795;
+const float POTENTIAL_COEF = -1.5;
+const float SKY_R2 = SKY_R * SKY_R;
+const float D_INNER_R2 = D_INNER_R * D_INNER_R;
+const float D_OUTER_R2 = D_OUTER_R * D_OUTER_R;
+
+#define INTEGRATOR_VERLET 0
+#define INTEGRATOR_BINET 1
+#define INTEGRATOR_RK45 2
+const float BINET_MAX_STEP = 0.1;
+const float BINET_MAX_CHANGE = 0.1;
+const int MAX_SKY_SAMPLES = 8;
+
+vec4 linearToSrgb(vec4 color) {
+    color.rgb = mix(12.92 * color.rgb, 1.055 * pow(color.rgb, vec3(1.0 / 2.4)) - 0.055, step(0.0031308, color.rgb));
+    return color;
+}
+
+// World direction of a cube map texel, the inverse of the face selection done by texture().
+vec3 cubeDirection(uint face, vec2 st) {
+    vec2 c = 2.0 * st - 1.0;
+    switch (face) {
+        case 0u: return vec3(1.0, -c.y, -c.x);
+        case 1u: return vec3(-1.0, -c.y, c.x);
+        case 2u: return vec3(c.x, 1.0, c.y);
+        case 3u: return vec3(c.x, -1.0, -c.y);
+        case 4u: return vec3(c.x, -c.y, 1.0);
+        default: return vec3(-c.x, -c.y, -1.0);
+    }
+}
+
+#if SKY_TILES
+void requestSkyTile(uint tile) {
+    if (tileRequested[tile] == 0u && atomicExchange(tileRequested[tile], 1u) == 0u) {
+        uint request = atomicAdd(numTileRequests, 1u);
+        if (request < MAX_TILE_REQUESTS) {
+            tileRequests[request] = tile;
+        }
+    }
+}
+
+// Bilinear sample of level at uv, from the top left of the panorama. False when the tile isn't
+// resident.
+bool sampleSkyTile(vec2 uv, int level, bool request, out vec4 color) {
+    ivec4 info = skyLevels[level];
+    vec2 texel = uv * vec2(info.xy);
+    ivec2 tile = clamp(ivec2(texel) / SKY_TILE_CONTENT, ivec2(0), ivec2(info.z - 1, (info.y - 1) / SKY_TILE_CONTENT));
+    uint index = uint(info.w + tile.y * info.z + tile.x);
+    if (request) {
+        requestSkyTile(index);
+    }
+    uint page = skyPageTable[index];
+    if (page == 0u) {
+        return false;
+    }
+    uint slot = page - 1u;
+    vec2 origin = vec2(slot % uint(skyAtlasTiles), slot / uint(skyAtlasTiles)) * float(SKY_TILE_SIZE) + 1.0;
+    // The border of the tile covers the half texel outside of its content.
+    vec2 inTile = clamp(texel - vec2(tile * SKY_TILE_CONTENT), vec2(-0.5), vec2(SKY_TILE_CONTENT) + 0.5);
+    color = textureLod(skyMap, (origin + inTile) / float(skyAtlasTiles * SKY_TILE_SIZE), 0.0);
+    return true;
+}
+
+// The finest resident level from level, which is requested.
+vec4 skyTileColor(vec2 uv, int level) {
+    vec4 color = vec4(0.0);
+    for (int l=level; l<numSkyLevels; l++) {
+        if (sampleSkyTile(uv, l, l == level, color)) {
+            break;
+        }
+    }
+    return color;
+}
+#endif
+
+// The sky filtered at lod, in levels of the texels per radian of skyTexelsPerRadian.
+vec4 skySample(vec3 direction, float lod) {
+#if SKY_CUBE
+    return textureLod(skyCube, direction, lod);
+#elif SKY_TILES
+    float theta = acos(clamp(direction.z / length(direction), -1.0, 1.0));
+    float phi = atan(direction.y, direction.x);
+    // Rows from the top, the equirectangular map has them from the bottom.
+    vec2 uv = vec2(fract(phi / (2.0 * PI)), 1.0 - theta / PI);
+    int level = clamp(int(lod), 0, numSkyLevels - 1);
+    int coarser = min(level + 1, numSkyLevels - 1);
+    return mix(skyTileColor(uv, level), skyTileColor(uv, coarser), clamp(lod - float(level), 0.0, 1.0));
+#else
+    return vec4(0.0);
+#endif
+}
+
+float skyTexelsPerRadian() {
+#if SKY_CUBE
+    // A texel covers 2 / size radians at the center of a face.
+    return 0.5 * float(textureSize(skyCube, 0).x);
+#elif SKY_TILES
+    // Vertically, horizontally the texels get narrower towards the poles.
+    return float(skyLevels[0].y) / PI;
+#else
+    return 1.0;
+#endif
+}
+
+// dx and dy span the footprint of the pixel around direction, the sky is filtered over it.
+vec4 skyColor(vec3 direction, vec3 dx, vec3 dy) {
+#if SKY_CUBE || SKY_TILES
+    // The footprint is an ellipse, its axes are given by the eigenvalues of the Gram matrix of
+    // dx and dy. It is covered with a few samples along the long axis at the level of the short
+    // one, so that the sky squeezed around the photon ring isn't blurred along the ring.
+    float a = dot(dx, dx);
+    float b = dot(dx, dy);
+    float c = dot(dy, dy);
+    float root = sqrt(0.25 * (a - c) * (a - c) + b * b);
+    float majorLength = sqrt(0.5 * (a + c) + root);
+    float minorLength = sqrt(max(0.5 * (a + c) - root, 0.0));
+    vec2 axis = a >= c ? vec2(majorLength * majorLength - c, b) : vec2(b, majorLength * majorLength - a);
+    vec3 major = dot(axis, axis) > 0.0 ? majorLength * normalize(axis.x * dx + axis.y * dy) : vec3(0.0);
+    int numSamples = int(clamp(ceil(majorLength / max(minorLength, 1e-6)), 1.0, float(MAX_SKY_SAMPLES)));
+    float texels = max(minorLength, majorLength / float(numSamples)) * skyTexelsPerRadian();
+    float lod = log2(max(texels, 1.0));
+    vec4 color = vec4(0.0);
+    for (int i=0; i<numSamples; i++) {
+        color += skySample(direction + ((float(i) + 0.5) / float(numSamples) - 0.5) * major, lod);
+    }
+    color /= float(numSamples);
+#else
+    // Nearest texel of the equirectangular map, like the CPU renderer.
+    int xSkyMap = int(fxSkyMap);
+    int ySkyMap = int(fySkyMap);
+    float theta = acos(direction.z / length(direction));
+    float phi = atan(direction.y, direction.x);
+    int u = int((phi / (2*PI)) * xSkyMap);
+    int v = int((theta / PI) * ySkyMap);
+    if (u < 0) { u = u + xSkyMap; }
+    if (v < 0) { v = v + ySkyMap; }
+    // texelFetch is undefined outside of the texture, the image load this replaced returned zero.
+    if (u >= xSkyMap || v >= ySkyMap) {
+        return vec4(0.0);
+    }
+    vec4 color = texelFetch(skyMap, ivec2(u, v), 0);
+#endif
+#if SKY_SRGB
+    // Sampling decoded it to linear, the output is not.
+    color = linearToSrgb(color);
+#endif
+    return color;
+}
+
+// Traces return vec4(exit direction, disc alpha), the exit direction being zero when the ray
+// doesn't reach the sky. resolve.glsl turns that into a color, so results can be cached and reused.
+vec4 hitSky(vec4 result, vec3 point) {
+    return vec4(normalize(point), result.a);
+}
+
+void crossAccretion(inout vec4 result, float sqrNorm) {
+    result.a += sin(PI * pow(((D_OUTER_R - sqrt(sqrNorm)) / (D_OUTER_R - D_INNER_R)), 2));
+}
+
+vec4 resolve(vec4 result, vec3 dx, vec3 dy) {
+    vec4 background = dot(result.xyz, result.xyz) > 0.25 ? skyColor(result.xyz, dx, dy) : vec4(0.0, 0.0, 0.0, 1.0);
+    return mix(background, vec4(1.0, 1.0, 0.98, result.a), result.a);
+}
+
+vec4 traceVerlet(vec3 origin, vec3 direction) {
+    vec4 result = vec4(0.0);
+    vec3 velocity = direction;
+    vec3 point = origin;
+    vec3 prevPoint;
+    float prevSqrNorm;
+    float sqrNorm = dot(point, point);
+    vec3 crossed = cross(point, velocity);
+    float h2 = dot(crossed, crossed);
+
+    for (int i=0; i<NUM_ITER; i++) {
+        prevPoint = point;
+        prevSqrNorm = sqrNorm;
+        point += velocity * STEP;
+        sqrNorm = dot(point, point);
+        vec3 accel = POTENTIAL_COEF * h2 * point / pow(sqrNorm, 2.5);
+        velocity += accel * STEP;
+
+        if (sqrNorm > SKY_R2) {
+            return hitSky(result, point);
+        } else if (sqrNorm < 1. && prevSqrNorm > 1.) {
+            return result;
+        } else if (sqrNorm >= D_INNER_R2 && sqrNorm <= D_OUTER_R2 && ((prevPoint.y > 0. && point.y < 0.) || (prevPoint.y < 0. && point.y > 0.))) {
+            crossAccretion(result, sqrNorm);
+        }
+    }
+    return result;
+}
+
+// Binet equation u'' + u = 1.5 u^2 for u = 1/r in the orbital plane, see geodesic.c.
+float binetAccel(float u) {
+    return 1.5 * u * u - u;
+}
+
+vec2 binetStep(vec2 state, float h) {
+    vec2 k1 = vec2(state.y, binetAccel(state.x));
+    vec2 s2 = state + 0.5 * h * k1;
+    vec2 k2 = vec2(s2.y, binetAccel(s2.x));
+    vec2 s3 = state + 0.5 * h * k2;
+    vec2 k3 = vec2(s3.y, binetAccel(s3.x));
+    vec2 s4 = state + h * k3;
+    vec2 k4 = vec2(s4.y, binetAccel(s4.x));
+    return state + h / 6.0 * (k1 + 2.0 * k2 + 2.0 * k3 + k4);
+}
+
+vec4 traceBinet(vec3 origin, vec3 direction) {
+    vec4 result = vec4(0.0);
+    // The orbit is r(phi) * (cos(phi) e1 + sin(phi) e2).
+    float radius = length(origin);
+    vec3 e1 = origin / radius;
+    vec3 d = normalize(direction);
+    float cosAlpha = dot(d, e1);
+    vec3 perp = d - cosAlpha * e1;
+    float sinAlpha = length(perp);
+    if (sinAlpha < 0.0001) {
+        return cosAlpha > 0.0 ? hitSky(result, e1) : result;
+    }
+    vec3 e2 = perp / sinAlpha;
+    float nextCrossing = atan(-e1.y, e2.y);
+    if (nextCrossing <= 0.0) {
+        nextCrossing += PI;
+    }
+    const float skyU = 1.0 / sqrt(SKY_R2);
+    vec2 state = vec2(1.0 / radius, -cosAlpha / (radius * sinAlpha));
+    float phi = 0.0;
+
+    for (int i=0; i<NUM_ITER; i++) {
+        float h = BINET_MAX_STEP;
+        if (abs(state.y) * h > BINET_MAX_CHANGE * state.x) {
+            h = BINET_MAX_CHANGE * state.x / abs(state.y);
+        }
+        vec2 next = binetStep(state, h);
+        float end = 1.0;
+        if (next.x < skyU) {
+            end = (state.x - skyU) / (state.x - next.x);
+        } else if (next.x > 1.0) {
+            end = (state.x - 1.0) / (state.x - next.x);
+        }
+        while (nextCrossing <= phi + end * h) {
+            // Cubic Hermite interpolation of u inside the step.
+            float f = (nextCrossing - phi) / h;
+            float f2 = f * f, f3 = f2 * f;
+            float crossingU = (2.0 * f3 - 3.0 * f2 + 1.0) * state.x + (f3 - 2.0 * f2 + f) * h * state.y
+                + (-2.0 * f3 + 3.0 * f2) * next.x + (f3 - f2) * h * next.y;
+            float sqrNorm = 1.0 / (crossingU * crossingU);
+            if (sqrNorm >= D_INNER_R2 && sqrNorm <= D_OUTER_R2) {
+                crossAccretion(result, sqrNorm);
+            }
+            nextCrossing += PI;
+        }
+        if (next.x < skyU) {
+            float endPhi = phi + end * h;
+            return hitSky(result, cos(endPhi) * e1 + sin(endPhi) * e2);
+        } else if (next.x > 1.0) {
+            return result;
+        }
+        phi += h;
+        state = next;
+    }
+    return result;
+}
+
+// Dormand-Prince 5(4) with error control, see rk45Step in geodesic.c.
+const float RK45_MAX_STEP = 0.25;
+const float RK45_MIN_STEP = 1e-4;
+const int RK45_MAX_ATTEMPTS = 16;
+
+vec3 photonAccel(float h2, vec3 point) {
+    float sqrNorm = dot(point, point);
+    return POTENTIAL_COEF * h2 * point / (sqrNorm * sqrNorm * sqrt(sqrNorm));
+}
+
+// Advances (point, velocity) by one accepted step, h is the proposed step on entry and the
+// accepted one on return, nextH the proposal for the next step.
+void rk45Step(inout vec3 point, inout vec3 velocity, float h2, inout float h, out float nextH) {
+    float speed = length(velocity);
+    h = min(h, RK45_MAX_STEP * length(point) / speed);
+    for (int attempt=1; ; attempt++) {
+        vec3 p0 = point, v0 = velocity;
+        vec3 kp1 = v0, kv1 = photonAccel(h2, p0);
+        vec3 p = p0 + h * (1.0 / 5.0) * kp1;
+        vec3 v = v0 + h * (1.0 / 5.0) * kv1;
+        vec3 kp2 = v, kv2 = photonAccel(h2, p);
+        p = p0 + h * (3.0 / 40.0 * kp1 + 9.0 / 40.0 * kp2);
+        v = v0 + h * (3.0 / 40.0 * kv1 + 9.0 / 40.0 * kv2);
+        vec3 kp3 = v, kv3 = photonAccel(h2, p);
+        p = p0 + h * (44.0 / 45.0 * kp1 - 56.0 / 15.0 * kp2 + 32.0 / 9.0 * kp3);
+        v = v0 + h * (44.0 / 45.0 * kv1 - 56.0 / 15.0 * kv2 + 32.0 / 9.0 * kv3);
+        vec3 kp4 = v, kv4 = photonAccel(h2, p);
+        p = p0 + h * (19372.0 / 6561.0 * kp1 - 25360.0 / 2187.0 * kp2 + 64448.0 / 6561.0 * kp3 - 212.0 / 729.0 * kp4);
+        v = v0 + h * (19372.0 / 6561.0 * kv1 - 25360.0 / 2187.0 * kv2 + 64448.0 / 6561.0 * kv3 - 212.0 / 729.0 * kv4);
+        vec3 kp5 = v, kv5 = photonAccel(h2, p);
+        p = p0 + h * (9017.0 / 3168.0 * kp1 - 355.0 / 33.0 * kp2 + 46732.0 / 5247.0 * kp3 + 49.0 / 176.0 * kp4 - 5103.0 / 18656.0 * kp5);
+        v = v0 + h * (9017.0 / 3168.0 * kv1 - 355.0 / 33.0 * kv2 + 46732.0 / 5247.0 * kv3 + 49.0 / 176.0 * kv4 - 5103.0 / 18656.0 * kv5);
+        vec3 kp6 = v, kv6 = photonAccel(h2, p);
+        p = p0 + h * (35.0 / 384.0 * kp1 + 500.0 / 1113.0 * kp3 + 125.0 / 192.0 * kp4 - 2187.0 / 6784.0 * kp5 + 11.0 / 84.0 * kp6);
+        v = v0 + h * (35.0 / 384.0 * kv1 + 500.0 / 1113.0 * kv3 + 125.0 / 192.0 * kv4 - 2187.0 / 6784.0 * kv5 + 11.0 / 84.0 * kv6);
+        vec3 kp7 = v, kv7 = photonAccel(h2, p);
+        vec3 errP = h * (71.0 / 57600.0 * kp1 - 71.0 / 16695.0 * kp3 + 71.0 / 1920.0 * kp4 - 17253.0 / 339200.0 * kp5 + 22.0 / 525.0 * kp6 - 1.0 / 40.0 * kp7);
+        vec3 errV = h * (71.0 / 57600.0 * kv1 - 71.0 / 16695.0 * kv3 + 71.0 / 1920.0 * kv4 - 17253.0 / 339200.0 * kv5 + 22.0 / 525.0 * kv6 - 1.0 / 40.0 * kv7);
+        vec3 absP = abs(errP), absV = abs(errV);
+        float err = max(max(max(absP.x, absP.y), absP.z) / (tolerance * (1.0 + length(p))),
+                        max(max(absV.x, absV.y), absV.z) / (tolerance * (1.0 + speed)));
+        float factor = err > 0.0 ? clamp(0.9 * pow(err, -0.2), 0.2, 5.0) : 5.0;
+        if (err <= 1.0 || h <= RK45_MIN_STEP || attempt >= RK45_MAX_ATTEMPTS) {
+            point = p;
+            velocity = v;
+            nextH = h * factor;
+            return;
+        }
+        h *= factor;
+    }
+}
+
+vec3 hermite(vec3 p0, vec3 v0, vec3 p1, vec3 v1, float h, float f) {
+    float f2 = f * f, f3 = f2 * f;
+    return (2.0 * f3 - 3.0 * f2 + 1.0) * p0 + (f3 - 2.0 * f2 + f) * h * v0 + (-2.0 * f3 + 3.0 * f2) * p1 + (f3 - f2) * h * v1;
+}
+
+vec3 hermiteTangent(vec3 p0, vec3 v0, vec3 p1, vec3 v1, float h, float f) {
+    float f2 = f * f;
+    return (6.0 * f2 - 6.0 * f) * p0 + (3.0 * f2 - 4.0 * f + 1.0) * h * v0 + (-6.0 * f2 + 6.0 * f) * p1 + (3.0 * f2 - 2.0 * f) * h * v1;
+}
+
+// Locates y = 0 (plane) or |p|^2 = sqrNorm on the Hermite curve of a step, see rk45Event in geodesic.c.
+vec3 rk45Event(vec3 p0, vec3 v0, vec3 p1, vec3 v1, float h, float f, bool plane, float sqrNorm) {
+    for (int i=0; i<3; i++) {
+        vec3 p = hermite(p0, v0, p1, v1, h, f);
+        vec3 dp = hermiteTangent(p0, v0, p1, v1, h, f);
+        float g = plane ? p.y : dot(p, p) - sqrNorm;
+        float dg = plane ? dp.y : 2.0 * dot(p, dp);
+        if (dg == 0.0) {
+            break;
+        }
+        f = clamp(f - g / dg, 0.0, 1.0);
+    }
+    return hermite(p0, v0, p1, v1, h, f);
+}
+
+vec4 traceRk45(vec3 origin, vec3 direction) {
+    vec4 result = vec4(0.0);
+    vec3 point = origin;
+    vec3 velocity = direction;
+    vec3 crossed = cross(point, velocity);
+    float h2 = dot(crossed, crossed);
+    float sqrNorm = dot(point, point);
+    float nextH = STEP;
+
+    for (int i=0; i<NUM_ITER; i++) {
+        vec3 prevPoint = point;
+        vec3 prevVelocity = velocity;
+        float prevSqrNorm = sqrNorm;
+        float h = nextH;
+        rk45Step(point, velocity, h2, h, nextH);
+        sqrNorm = dot(point, point);
+
+        bool horizon = sqrNorm < 1. && prevSqrNorm > 1.;
+        if (!horizon && ((prevPoint.y > 0. && point.y < 0.) || (prevPoint.y < 0. && point.y > 0.))) {
+            vec3 crossing = rk45Event(prevPoint, prevVelocity, point, velocity, h, prevPoint.y / (prevPoint.y - point.y), true, 0.0);
+            float crossingSqrNorm = dot(crossing, crossing);
+            if (crossingSqrNorm >= D_INNER_R2 && crossingSqrNorm <= D_OUTER_R2) {
+                crossAccretion(result, crossingSqrNorm);
+            }
+        }
+        if (sqrNorm > SKY_R2) {
+            float f = (SKY_R2 - prevSqrNorm) / (sqrNorm - prevSqrNorm);
+            return hitSky(result, rk45Event(prevPoint, prevVelocity, point, velocity, h, f, false, SKY_R2));
+        } else if (horizon) {
+            return result;
+        }
+    }
+    return result;
+}
+
+// The integrator is chosen at compile time, so each variant only holds one.
+vec4 trace(vec3 origin, vec3 direction) {
+#if INTEGRATOR == INTEGRATOR_BINET
+    return traceBinet(origin, direction);
+#elif INTEGRATOR == INTEGRATOR_RK45
+    return traceRk45(origin, direction);
+#else
+    return traceVerlet(origin, direction);
+#endif
+}
+
+// Primary ray direction through normalized image coordinates st.
+vec3 cameraDirection(vec2 st) {
+    float halfHeight = eyeAndHalfHeight.w;
+    float halfWidth = halfHeight * float(nx) / ny;
+    vec3 lowerLeftCorner = -halfWidth * u.xyz - halfHeight * v.xyz - w.xyz;
+    vec3 horizontal = 2.0 * halfWidth * u.xyz;
+    vec3 vertical = 2.0 * halfHeight * v.xyz;
+    return lowerLeftCorner + st.x * horizontal + st.y * vertical;
+}
@@ -0,0 +1,145 @@
+// Reuses the results of the last frame for the new eye. The hole is spherically symmetric, so
+// once moved along its first, nearly straight, stretch to the radius of the history eye, a ray
+// from the new eye is a ray of the history eye rotated around the hole. A pixel takes the results
+// of the history pixels with that direction and rotates them back, keeping an estimate of how
+// far its exit direction can be from the true one. Pixels where it gets over the threshold, or
+// whose history footprint mixes fates (silhouettes, disc edges, disocclusions), are listed for
+// retrace.glsl. The disc breaks the symmetry and is traced again whenever the eye moves.
+layout(local_size_x = 32, local_size_y = 32) in;
+
+// Rays passing closer to the hole than this are strongly bent and always traced again.
+const float STRONG_FIELD_IMPACT = 4.0;
+
+void retrace(ivec2 pixel) {
+    uint index = atomicAdd(numRetraced, 1u);
+    retraced[index] = uint(pixel.x) | (uint(pixel.y) << 16);
+    if (index % 64u == 0u) {
+        atomicAdd(numGroupsX, 1u);
+    }
+}
+
+// Rotation around the hole taking the unit vector a to the unit vector b, applied to x.
+vec3 rotateTo(vec3 a, vec3 b, vec3 x) {
+    vec3 k = cross(a, b);
+    float c = dot(a, b);
+    return c * x + cross(k, x) + k * dot(k, x) / (1.0 + c);
+}
+
+// Normalized image coordinates of direction in the history camera, the inverse of cameraDirection.
+bool historyCoords(vec3 direction, out vec2 st) {
+    float depth = -dot(direction, historyW.xyz);
+    if (depth <= 0.0) {
+        return false;
+    }
+    vec2 halfSize = vec2(eyeAndHalfHeight.w * historyNx / historyNy, eyeAndHalfHeight.w);
+    vec2 p = vec2(dot(direction, historyU.xyz), dot(direction, historyV.xyz)) / depth;
+    st = (p + halfSize) / (2.0 * halfSize);
+    return true;
+}
+
+bool sameFate(vec4 a, vec4 b) {
+    bool aSky = dot(a.xyz, a.xyz) > 0.25;
+    bool bSky = dot(b.xyz, b.xyz) > 0.25;
+    return aSky == bSky && (a.a > 0.0) == (b.a > 0.0);
+}
+
+// True when a history pixel within margin of p crosses the disc.
+bool discNear(ivec2 p, int margin) {
+    for (int y=-1; y<=1; y++) {
+        for (int x=-1; x<=1; x++) {
+            for (int m=margin; m>0; m/=2) {
+                ivec2 q = clamp(p + m * ivec2(x, y), ivec2(0), ivec2(historyNx, historyNy) - 1);
+                if (imageLoad(history, q).a > 0.0) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// True when the straight line of the ray crosses the disc, which catches the near side of the
+// disc appearing as the eye leaves its plane.
+bool straightCrossesDisc(vec3 origin, vec3 direction) {
+    float t = -origin.y / direction.y;
+    vec3 crossing = origin + t * direction;
+    return t > 0.0 && dot(crossing, crossing) <= D_OUTER_R2;
+}
+
+void main() {
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    if (pixel.x >= int(nx) || pixel.y >= int(ny)) {
+        return;
+    }
+    if (historyValid == 0) {
+        retrace(pixel);
+        return;
+    }
+
+    vec3 eye = eyeAndHalfHeight.xyz;
+    vec3 direction = normalize(cameraDirection(vec2(pixel) / vec2(nx, ny)));
+    // Move along the ray, nearly straight this close to the eye, to where it crosses the sphere
+    // of the history eye. From there it is the history ray rotated around the hole.
+    float historyRadius = length(historyEye.xyz);
+    float along = dot(eye, direction);
+    float discriminant = along * along - dot(eye, eye) + historyRadius * historyRadius;
+    float impact = length(cross(eye, direction));
+    if (discriminant < 0.0 || impact < STRONG_FIELD_IMPACT) {
+        retrace(pixel);
+        return;
+    }
+    float s = -along + (along > 0.0 ? sqrt(discriminant) : -sqrt(discriminant));
+    vec3 start = normalize(eye + s * direction);
+    vec3 historyEyeDir = historyEye.xyz / historyRadius;
+    vec2 st;
+    if (dot(start, historyEyeDir) <= 0.0 || !historyCoords(rotateTo(start, historyEyeDir, direction), st)) {
+        retrace(pixel);
+        return;
+    }
+    vec2 p = st * vec2(historyNx, historyNy);
+    ivec2 p0 = ivec2(floor(p));
+    if (p0.x < 0 || p0.y < 0 || p0.x + 1 >= int(historyNx) || p0.y + 1 >= int(historyNy)) {
+        retrace(pixel);
+        return;
+    }
+
+    vec4 r00 = imageLoad(history, p0);
+    vec4 r10 = imageLoad(history, p0 + ivec2(1, 0));
+    vec4 r01 = imageLoad(history, p0 + ivec2(0, 1));
+    vec4 r11 = imageLoad(history, p0 + ivec2(1, 1));
+    if (!sameFate(r00, r10) || !sameFate(r00, r01) || !sameFate(r00, r11)) {
+        retrace(pixel);
+        return;
+    }
+    float error = max(max(imageLoad(historyError, p0).r, imageLoad(historyError, p0 + ivec2(1, 0)).r),
+                      max(imageLoad(historyError, p0 + ivec2(0, 1)).r, imageLoad(historyError, p0 + ivec2(1, 1)).r));
+    // Bilinear error of the footprint, large where the image bends around the photon ring.
+    error += 0.25 * length(r00 + r11 - r10 - r01);
+    // The ray bends by 1.5 b^2 / r^4 per unit length over the straight move.
+    float r2 = historyRadius * historyRadius;
+    error += 1.5 * impact * impact * abs(s) / (r2 * r2);
+    // The disc is not symmetric and moves with parallax, its crossings being at least
+    // |eye| - D_OUTER_R away.
+    float discMotion = distance(eye, historyEye.xyz) / max(length(eye) - D_OUTER_R, 1.0);
+    if (r00.a > 0.0 || straightCrossesDisc(eye, direction)) {
+        error += discMotion;
+    } else if (discMotion > 0.0) {
+        // The disc may have moved over this pixel.
+        float pixelAngle = 2.0 * eyeAndHalfHeight.w / historyNy;
+        if (discNear(p0, int(ceil(discMotion / pixelAngle)))) {
+            retrace(pixel);
+            return;
+        }
+    }
+    if (error > threshold) {
+        retrace(pixel);
+        return;
+    }
+
+    vec2 f = p - vec2(p0);
+    vec4 result = mix(mix(r00, r10, f.x), mix(r01, r11, f.x), f.y);
+    if (dot(result.xyz, result.xyz) > 0.0) {
+        result.xyz = rotateTo(historyEyeDir, start, normalize(result.xyz));
+    }
+    storeCurrent(pixel, result, error);
+}
@@ -0,0 +1,33 @@
+// Temporal reprojection state shared by reproject.glsl and retrace.glsl, see reprojection.c.
+layout(std430, binding = 1) buffer reprojection
+{
+    // Arguments of the indirect dispatch of retrace.glsl, one group per 64 listed pixels.
+    uint numGroupsX;
+    uint numGroupsY;
+    uint numGroupsZ;
+    uint numRetraced;
+    // Camera the history was rendered with.
+    vec4 historyEye;
+    vec4 historyU;
+    vec4 historyV;
+    vec4 historyW;
+    // Largest accumulated error estimate of a reused pixel, in radians.
+    float threshold;
+    int historyValid;
+    // Resolution of the history, the render resolution can change.
+    float historyNx;
+    float historyNy;
+    // Pixels to trace again, x | y << 16.
+    uint retraced[];
+};
+
+// Results of the last frame and their accumulated error, and those of this frame.
+layout(rgba32f, binding = 4) uniform readonly image2D history;
+layout(r32f, binding = 5) uniform readonly image2D historyError;
+layout(rgba32f, binding = 6) uniform writeonly image2D current;
+layout(r32f, binding = 7) uniform writeonly image2D currentError;
+
+void storeCurrent(ivec2 pixel, vec4 result, float error) {
+    imageStore(current, pixel, result);
+    imageStore(currentError, pixel, vec4(error));
+}
@@ -0,0 +1,13 @@
+// Renders a view from the cube map of results traced by cubemap.glsl from the same eye.
+layout(local_size_x = 32, local_size_y = 32) in;
+layout(rgba32f, binding = 1) uniform writeonly image2D results;
+layout(binding = 2) uniform samplerCube cache;
+
+void main() {
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    if (pixel.x >= int(nx) || pixel.y >= int(ny)) {
+        return;
+    }
+    vec2 st = vec2(pixel) / vec2(nx, ny);
+    imageStore(results, pixel, textureLod(cache, cameraDirection(st), 0.0));
+}
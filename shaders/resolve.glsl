@@ -0,0 +1,52 @@
+// Turns the results of a frame into colors. The sky is filtered over the footprint of the pixel,
+// given by the differences between the exit directions of neighbouring pixels, which grows where
+// the hole magnifies the sky and gets long and thin where it squeezes it around the photon ring.
+layout(local_size_x = 32, local_size_y = 32) in;
+layout(rgba32f, binding = 0) uniform image2D pixels;
+layout(rgba32f, binding = 3) uniform image2D accumulation;
+layout(binding = 5) uniform sampler2D results;
+
+// Longer than any difference between exit directions.
+const float NO_NEIGHBOUR = 4.0;
+
+vec3 exitDifference(vec3 direction, ivec2 neighbour) {
+    if (neighbour.x < 0 || neighbour.y < 0 || neighbour.x >= int(nx) || neighbour.y >= int(ny)) {
+        return vec3(NO_NEIGHBOUR);
+    }
+    vec3 other = texelFetch(results, neighbour, 0).xyz;
+    if (dot(other, other) <= 0.25) {
+        return vec3(NO_NEIGHBOUR);
+    }
+    return other - direction;
+}
+
+// The shorter of the differences with the neighbours along axis, so that the footprint doesn't
+// spread over silhouettes and disc edges. Zero when neither reaches the sky.
+vec3 footprintAxis(vec3 direction, ivec2 pixel, ivec2 axis) {
+    vec3 a = exitDifference(direction, pixel - axis);
+    vec3 b = exitDifference(direction, pixel + axis);
+    vec3 d = dot(a, a) < dot(b, b) ? a : b;
+    return dot(d, d) < NO_NEIGHBOUR * NO_NEIGHBOUR ? d : vec3(0.0);
+}
+
+void main() {
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    if (pixel.x >= int(nx) || pixel.y >= int(ny)) {
+        return;
+    }
+    vec4 result = texelFetch(results, pixel, 0);
+    vec3 dx = footprintAxis(result.xyz, pixel, ivec2(1, 0));
+    vec3 dy = footprintAxis(result.xyz, pixel, ivec2(0, 1));
+    vec4 color = resolve(result, dx, dy);
+
+    if (sampleIndex >= 0) {
+        // Progressive rendering, average all the jittered samples of the pixel so far.
+        color = clamp(color, 0.0, 1.0);
+        if (sampleIndex > 0) {
+            color += imageLoad(accumulation, pixel);
+        }
+        imageStore(accumulation, pixel, color);
+        color /= float(sampleIndex + 1);
+    }
+    imageStore(pixels, pixel, color);
+}
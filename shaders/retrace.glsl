@@ -0,0 +1,12 @@
+// Traces the pixels listed by reproject.glsl, dispatched indirectly.
+layout(local_size_x = 64) in;
+
+void main() {
+    if (gl_GlobalInvocationID.x >= numRetraced) {
+        return;
+    }
+    uint index = retraced[gl_GlobalInvocationID.x];
+    ivec2 pixel = ivec2(index & 0xffffu, index >> 16);
+    vec2 st = vec2(pixel) / vec2(nx, ny);
+    storeCurrent(pixel, trace(eyeAndHalfHeight.xyz, normalize(cameraDirection(st))), 0.0);
+}
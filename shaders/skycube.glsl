@@ -0,0 +1,27 @@
+// Converts the equirectangular sky map into the faces of a cube map, see buildSkyCube in sky.c.
+layout(local_size_x = 32, local_size_y = 32) in;
+layout(rgba8, binding = 4) uniform writeonly imageCube faces;
+
+void main() {
+    ivec3 texel = ivec3(gl_GlobalInvocationID);
+    int size = imageSize(faces).x;
+    if (texel.x >= size || texel.y >= size) {
+        return;
+    }
+    // 2x2 bilinear samples per texel, the map is much denser than the faces towards the poles.
+    vec4 color = vec4(0.0);
+    for (int y=0; y<2; y++) {
+        for (int x=0; x<2; x++) {
+            vec2 st = (vec2(texel.xy) + 0.25 + 0.5 * vec2(x, y)) / float(size);
+            vec3 direction = normalize(cubeDirection(gl_GlobalInvocationID.z, st));
+            vec2 uv = vec2(atan(direction.y, direction.x) / (2.0 * PI), acos(direction.z) / PI);
+            color += textureLod(skyMap, uv, 0.0);
+        }
+    }
+    color *= 0.25;
+#if SKY_SRGB
+    // The faces are written through an RGBA8 view of the sRGB texture.
+    color = linearToSrgb(color);
+#endif
+    imageStore(faces, texel, color);
+}
@@ -1,6 +1,7 @@
 #version 430
+in vec4 trailColor;
 out vec4 color;
 
 void main() {
-    color = vec4(1, 0, 0, 0);
+    color = trailColor;
 }
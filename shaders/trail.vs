@@ -0,0 +1,17 @@
+#version 430
+// World to clip space, see viewProjection in math.c.
+uniform mat4 viewProjection;
+uniform int numTrails;
+uniform int numPhotons;
+// The points of every step, trail after trail, see trails.c.
+layout(std430, binding = 4) readonly buffer trailPoints
+{
+    float points[];
+};
+out vec4 trailColor;
+
+void main() {
+    int i = 3 * (gl_VertexID * numTrails + gl_InstanceID);
+    gl_Position = viewProjection * vec4(points[i], points[i + 1], points[i + 2], 1.0);
+    trailColor = gl_InstanceID < numPhotons ? vec4(1, 0, 0, 0) : vec4(0, 0.6, 1, 0);
+}
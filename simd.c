@@ -0,0 +1,174 @@
+// Ray-packet version of traceRay: integrates SIMD_LANES neighbouring rays at once in
+// structure-of-arrays form, 16 lanes with AVX-512 and 8 with AVX2. traceRay stays the
+// scalar reference. Finished lanes get a zero velocity and h2 so they stop moving, and
+// the rare sky, horizon and disc events are resolved per lane in scalar code.
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_ENABLED
+#endif
+
+#if defined(__AVX512F__)
+
+#define SIMD_LANES 16
+typedef __m512 vf;
+typedef __mmask16 vmask;
+
+static inline vf vSet(float x) { return _mm512_set1_ps(x); }
+static inline vf vLoad(const float *p) { return _mm512_loadu_ps(p); }
+static inline void vStore(float *p, vf a) { _mm512_storeu_ps(p, a); }
+static inline vf vAdd(vf a, vf b) { return _mm512_add_ps(a, b); }
+static inline vf vSub(vf a, vf b) { return _mm512_sub_ps(a, b); }
+static inline vf vMul(vf a, vf b) { return _mm512_mul_ps(a, b); }
+static inline vf vFmadd(vf a, vf b, vf c) { return _mm512_fmadd_ps(a, b, c); }
+static inline vf vRsqrtEstimate(vf a) { return _mm512_rsqrt14_ps(a); }
+static inline vmask vGt(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+static inline vmask vLt(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+static inline vmask vGe(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+static inline vmask vLe(vf a, vf b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+static inline vmask vAnd(vmask a, vmask b) { return a & b; }
+static inline vmask vOr(vmask a, vmask b) { return a | b; }
+static inline int vBits(vmask a) { return (int)a; }
+static inline vmask vFromBits(int bits) { return (vmask)bits; }
+static inline vf vZeroWhere(vmask m, vf a) { return _mm512_maskz_mov_ps((vmask)~m, a); }
+
+#elif defined(__AVX2__)
+
+#define SIMD_LANES 8
+typedef __m256 vf;
+typedef __m256 vmask;
+
+static inline vf vSet(float x) { return _mm256_set1_ps(x); }
+static inline vf vLoad(const float *p) { return _mm256_loadu_ps(p); }
+static inline void vStore(float *p, vf a) { _mm256_storeu_ps(p, a); }
+static inline vf vAdd(vf a, vf b) { return _mm256_add_ps(a, b); }
+static inline vf vSub(vf a, vf b) { return _mm256_sub_ps(a, b); }
+static inline vf vMul(vf a, vf b) { return _mm256_mul_ps(a, b); }
+#ifdef __FMA__
+static inline vf vFmadd(vf a, vf b, vf c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+static inline vf vFmadd(vf a, vf b, vf c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+static inline vf vRsqrtEstimate(vf a) { return _mm256_rsqrt_ps(a); }
+static inline vmask vGt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline vmask vLt(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline vmask vGe(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline vmask vLe(vf a, vf b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline vmask vAnd(vmask a, vmask b) { return _mm256_and_ps(a, b); }
+static inline vmask vOr(vmask a, vmask b) { return _mm256_or_ps(a, b); }
+static inline int vBits(vmask a) { return _mm256_movemask_ps(a); }
+static inline vmask vFromBits(int bits) {
+    const __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i selected = _mm256_and_si256(_mm256_set1_epi32(bits), laneBits);
+    return _mm256_castsi256_ps(_mm256_cmpeq_epi32(selected, laneBits));
+}
+static inline vf vZeroWhere(vmask m, vf a) { return _mm256_andnot_ps(m, a); }
+
+#endif
+
+#ifdef SIMD_ENABLED
+
+// 1 / pow(x, 2.5) as rsqrt(x)^5, with one Newton-Raphson step to get back to full float precision.
+static inline vf vInvPow2_5(vf x) {
+    vf y = vRsqrtEstimate(x);
+    vf halfX = vMul(vSet(0.5f), x);
+    y = vMul(y, vSub(vSet(1.5f), vMul(halfX, vMul(y, y))));
+    vf y2 = vMul(y, y);
+    return vMul(vMul(y2, y2), y);
+}
+
+// Traces count <= SIMD_LANES rays sharing the same origin, directions given in SoA form.
+// numSteps is incremented by the number of steps of every ray, like traceRay.
+static void tracePacket(SkyMap *sky, v3 origin, float *dirX, float *dirY, float *dirZ, int count, v4 *colors, int *numSteps) {
+    float laneX[SIMD_LANES], laneY[SIMD_LANES], laneZ[SIMD_LANES], laneSqrNorm[SIMD_LANES];
+    float h2s[SIMD_LANES];
+    bool crossedAccretion[SIMD_LANES];
+    for (int i=0; i<SIMD_LANES; i++) {
+        colors[i] = newV4(0.0f, 0.0f, 0.0f, 1.0f);
+        crossedAccretion[i] = false;
+        v3 direction = newV3(dirX[i], dirY[i], dirZ[i]);
+        v3 crossed = crossV3(origin, direction);
+        h2s[i] = i < count ? dotV3(crossed, crossed) : 0.0f;
+    }
+
+    vf px = vSet(origin.x), py = vSet(origin.y), pz = vSet(origin.z);
+    vf vx = vLoad(dirX), vy = vLoad(dirY), vz = vLoad(dirZ);
+    vf h2 = vLoad(h2s);
+    vf sqrNorm = vSet(dotV3(origin, origin));
+    int activeBits = (1 << count) - 1;
+    vmask done = vFromBits(~activeBits & ((1 << SIMD_LANES) - 1));
+    vx = vZeroWhere(done, vx);
+    vy = vZeroWhere(done, vy);
+    vz = vZeroWhere(done, vz);
+
+    const vf step = vSet(STEP);
+    const vf zero = vSet(0.0f);
+    const vf one = vSet(1.0f);
+    const vf vSkyR2 = vSet(skyR2);
+    const vf vInnerR2 = vSet(dInnerR2);
+    const vf vOuterR2 = vSet(dOuterR2);
+    const vf stepPotential = vSet(STEP * potentialCoef);
+
+    int i;
+    for (i=0; i<NUM_ITER && activeBits; i++) {
+        vf prevY = py;
+        vf prevSqrNorm = sqrNorm;
+        px = vFmadd(vx, step, px);
+        py = vFmadd(vy, step, py);
+        pz = vFmadd(vz, step, pz);
+        sqrNorm = vFmadd(px, px, vFmadd(py, py, vMul(pz, pz)));
+        vf k = vMul(vMul(stepPotential, h2), vInvPow2_5(sqrNorm));
+        vx = vFmadd(k, px, vx);
+        vy = vFmadd(k, py, vy);
+        vz = vFmadd(k, pz, vz);
+
+        int skyBits = vBits(vGt(sqrNorm, vSkyR2));
+        int horizonBits = vBits(vAnd(vLt(sqrNorm, one), vGt(prevSqrNorm, one)));
+        vmask inDisc = vAnd(vGe(sqrNorm, vInnerR2), vLe(sqrNorm, vOuterR2));
+        vmask flipped = vOr(vAnd(vGt(prevY, zero), vLt(py, zero)), vAnd(vLt(prevY, zero), vGt(py, zero)));
+        int discBits = vBits(vAnd(inDisc, flipped));
+        int eventBits = (skyBits | horizonBits | discBits) & activeBits;
+        if (!eventBits) {
+            continue;
+        }
+
+        vStore(laneX, px);
+        vStore(laneY, py);
+        vStore(laneZ, pz);
+        vStore(laneSqrNorm, sqrNorm);
+        int finishedBits = 0;
+        for (int lane=0; lane<SIMD_LANES; lane++) {
+            int bit = 1 << lane;
+            if (!(eventBits & bit)) {
+                continue;
+            }
+            if ((skyBits | horizonBits) & bit) {
+                *numSteps += i + 1;
+            }
+            if (skyBits & bit) {
+                colors[lane] = hitSky(sky, colors[lane], crossedAccretion[lane], newV3(laneX[lane], laneY[lane], laneZ[lane]));
+                finishedBits |= bit;
+            } else if (horizonBits & bit) {
+                colors[lane] = hitHorizon(colors[lane], crossedAccretion[lane]);
+                finishedBits |= bit;
+            } else {
+                crossAccretion(&colors[lane], &crossedAccretion[lane], laneSqrNorm[lane]);
+            }
+        }
+        if (finishedBits) {
+            activeBits &= ~finishedBits;
+            vmask finished = vFromBits(finishedBits);
+            vx = vZeroWhere(finished, vx);
+            vy = vZeroWhere(finished, vy);
+            vz = vZeroWhere(finished, vz);
+            h2 = vZeroWhere(finished, h2);
+        }
+    }
+    for (int lane=0; lane<count; lane++) {
+        if (activeBits & (1 << lane)) {
+            *numSteps += i;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,229 @@
+// Sky map storage on the GPU. The 8 bit source is kept at 8 bits per channel instead of being
+// expanded to floats: as RGBA8, as sRGB so that filtered lookups average in linear space, or
+// block compressed with BPTC by the driver on upload, 1 byte per texel. The equirectangular map
+// is converted once into a mipmapped cube map, which skyColor in shaders/geodesic.glsl samples
+// by direction, without trigonometry, at the level matching the footprint of the pixel. The
+// result is kept in a cache file, see skycache.c. The CPU renderer keeps RGBA8 texels, see
+// SkyMap in geodesic.c.
+
+#define SKY_MAP_UNIT 1
+#define SKY_CUBE_UNIT 4
+// Image unit the renderers write their results (exit direction, disc alpha) to.
+#define RESULTS_UNIT 1
+// Texture unit resolve.glsl reads them from.
+#define RESOLVE_UNIT 5
+
+// Nothing is traced by these, any integrator will do.
+static GLuint skyCubeProgram() {
+    char *path = "shaders/skycube.glsl";
+    return kernelProgram("skyCube", &path, 1, INTEGRATOR_VERLET);
+}
+
+static GLuint resolveProgram() {
+    char *path = "shaders/resolve.glsl";
+    return kernelProgram("resolve", &path, 1, INTEGRATOR_VERLET);
+}
+
+static void checkCompressed(GLenum target) {
+    GLint compressed;
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_COMPRESSED, &compressed);
+    if (!compressed) {
+        printf("The driver did not compress the sky map\n");
+    }
+}
+
+static GLenum skyInternalFormat(SkyFormat format) {
+    if (format == SKY_SRGB8) {
+        return GL_SRGB8_ALPHA8;
+    } else if (format == SKY_BPTC) {
+        return GL_COMPRESSED_RGBA_BPTC_UNORM;
+    }
+    return GL_RGBA8;
+}
+
+static int skyCubeNumLevels(int faceSize) {
+    int numLevels = 1;
+    while ((faceSize >> numLevels) > 0) {
+        numLevels++;
+    }
+    return numLevels;
+}
+
+// Creates a sky texture bound to its unit, the equirectangular map for GL_TEXTURE_2D.
+static GLuint newSkyTexture(GLenum target) {
+    GLuint textureId;
+    glGenTextures(1, &textureId);
+    if (target == GL_TEXTURE_2D) {
+        glActiveTexture(GL_TEXTURE0 + SKY_MAP_UNIT);
+        glBindTexture(GL_TEXTURE_2D, textureId);
+        // Bilinear for the cube map conversion, the direct lookups fetch texels.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    } else {
+        glActiveTexture(GL_TEXTURE0 + SKY_CUBE_UNIT);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, textureId);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    }
+    return textureId;
+}
+
+// Uploads RGBA8 texels to the sky map texture.
+static GLuint uploadSkyMap(unsigned char *texels, int width, int height, SkyFormat format) {
+    GLint maxSize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (width > maxSize || height > maxSize) {
+        printf("Sky map %dx%d is larger than the maximum texture size %d\n", width, height, maxSize);
+        exit(-1);
+    }
+    GLuint textureId = newSkyTexture(GL_TEXTURE_2D);
+    glTexImage2D(GL_TEXTURE_2D, 0, skyInternalFormat(format), width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    if (format == SKY_BPTC) {
+        checkCompressed(GL_TEXTURE_2D);
+    }
+    return textureId;
+}
+
+// Uploads every level of the RGBA8 cube map sourceId again as BPTC, compressed by the driver.
+static GLuint compressSkyCube(GLuint sourceId, int faceSize, int numLevels) {
+    unsigned char *texels = malloc((size_t)faceSize * faceSize * 4);
+    GLuint textureId = newSkyTexture(GL_TEXTURE_CUBE_MAP);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, numLevels - 1);
+    for (int level=0; level<numLevels; level++) {
+        int size = faceSize >> level;
+        for (int face=0; face<6; face++) {
+            glBindTexture(GL_TEXTURE_CUBE_MAP, sourceId);
+            glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+            glBindTexture(GL_TEXTURE_CUBE_MAP, textureId);
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_COMPRESSED_RGBA_BPTC_UNORM, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+        }
+    }
+    free(texels);
+    glDeleteTextures(1, &sourceId);
+    checkCompressed(GL_TEXTURE_CUBE_MAP_POSITIVE_X);
+    return textureId;
+}
+
+// Converts the equirectangular sky map bound to SKY_MAP_UNIT into a mipmapped cube map with
+// faceSize x faceSize faces, bound to SKY_CUBE_UNIT. The map can be deleted afterwards.
+static GLuint buildSkyCube(int faceSize, SkyFormat format) {
+    int numLevels = skyCubeNumLevels(faceSize);
+    GLuint textureId = newSkyTexture(GL_TEXTURE_CUBE_MAP);
+    glTexStorage2D(GL_TEXTURE_CUBE_MAP, numLevels, format == SKY_SRGB8 ? GL_SRGB8_ALPHA8 : GL_RGBA8, faceSize, faceSize);
+    // sRGB textures can't be bound as images, the faces are written through an RGBA8 view.
+    GLuint viewId;
+    glGenTextures(1, &viewId);
+    glTextureView(viewId, GL_TEXTURE_CUBE_MAP, textureId, GL_RGBA8, 0, 1, 0, 6);
+    glBindImageTexture(SKY_CUBE_UNIT, viewId, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA8);
+
+    glUseProgram(skyCubeProgram());
+    glDispatchCompute((faceSize + 31) / 32, (faceSize + 31) / 32, 6);
+    glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+    glDeleteTextures(1, &viewId);
+    // Mipmaps of an sRGB texture are averaged in linear space.
+    glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+    if (format == SKY_BPTC) {
+        textureId = compressSkyCube(textureId, faceSize, numLevels);
+    }
+    return textureId;
+}
+
+// Uploads the levels of a cache opened with openSkyCache.
+static GLuint uploadSkyCache(SkyCacheHeader *header, unsigned char *texels) {
+    bool cube = header->faceSize > 0;
+    GLenum target = cube ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+    int width = cube ? header->faceSize : header->width;
+    int height = cube ? header->faceSize : header->height;
+    GLuint textureId = newSkyTexture(target);
+    glTexStorage2D(target, header->numLevels, skyInternalFormat(header->format), width, height);
+    for (int level=0; level<header->numLevels; level++) {
+        int levelWidth = width >> level > 0 ? width >> level : 1;
+        int levelHeight = height >> level > 0 ? height >> level : 1;
+        size_t size = skyCacheImageSize(header, level);
+        for (int face=0; face<(cube ? 6 : 1); face++) {
+            GLenum faceTarget = cube ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+            if (header->format == SKY_BPTC) {
+                glCompressedTexSubImage2D(faceTarget, level, 0, 0, levelWidth, levelHeight, GL_COMPRESSED_RGBA_BPTC_UNORM, (GLsizei)size, texels);
+            } else {
+                glTexSubImage2D(faceTarget, level, 0, 0, levelWidth, levelHeight, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+            }
+            texels += size;
+        }
+    }
+    return textureId;
+}
+
+// Reads the levels of textureId back into the cache of the image at sourcePath.
+static void writeSkyCache(const char *sourcePath, SkyCacheHeader *header, GLuint textureId) {
+    FILE *file = createSkyCache(sourcePath, header);
+    if (!file) {
+        return;
+    }
+    bool cube = header->faceSize > 0;
+    glActiveTexture(GL_TEXTURE0 + (cube ? SKY_CUBE_UNIT : SKY_MAP_UNIT));
+    glBindTexture(cube ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D, textureId);
+    unsigned char *texels = malloc(skyCacheImageSize(header, 0));
+    for (int level=0; level<header->numLevels; level++) {
+        for (int face=0; face<(cube ? 6 : 1); face++) {
+            GLenum faceTarget = cube ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face : GL_TEXTURE_2D;
+            if (header->format == SKY_BPTC) {
+                glGetCompressedTexImage(faceTarget, level, texels);
+            } else {
+                glGetTexImage(faceTarget, level, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+            }
+            fwrite(texels, skyCacheImageSize(header, level), 1, file);
+        }
+    }
+    free(texels);
+    closeSkyCache(file, sourcePath, header);
+}
+
+// Uploads the sky map read into source, as a cube map with faceSize x faceSize faces (-1 for a
+// quarter of the map width), or as the equirectangular map itself when faceSize is 0. The texels
+// come from the cache when it is up to date, otherwise they were decoded and the cache is written.
+static GLuint uploadSky(SkySource *source, int *width, int *height) {
+    if (!source->texels) {
+        printf("Could not load sky map %s\n", source->path);
+        exit(-1);
+    }
+    SkyCacheHeader header = source->header;
+    *width = source->width;
+    *height = source->height;
+    if (source->cached) {
+        GLuint textureId = uploadSkyCache(&header, source->texels);
+        freeSkySource(source);
+        return textureId;
+    }
+
+    SkyFormat format = (SkyFormat)header.format;
+    header.width = *width;
+    header.height = *height;
+    GLuint textureId;
+    if (header.faceSize == 0) {
+        textureId = uploadSkyMap(source->texels, *width, *height, format);
+        header.numLevels = 1;
+    } else {
+        // The cube map is compressed after the conversion, which reads the map uncompressed.
+        GLuint mapId = uploadSkyMap(source->texels, *width, *height, format == SKY_BPTC ? SKY_RGBA8 : format);
+        header.faceSize = header.faceSize > 0 ? header.faceSize : *width / 4;
+        header.numLevels = skyCubeNumLevels(header.faceSize);
+        textureId = buildSkyCube(header.faceSize, format);
+        glDeleteTextures(1, &mapId);
+    }
+    freeSkySource(source);
+    writeSkyCache(source->path, &header, textureId);
+    return textureId;
+}
+
+// Colors the output image from the results in resultsId, the texture of an nx x ny image.
+// The ShaderData SSBO must be up to date.
+static void resolveResults(GLuint resultsId, int nx, int ny) {
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    glActiveTexture(GL_TEXTURE0 + RESOLVE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, resultsId);
+    glUseProgram(resolveProgram());
+    glDispatchCompute((nx + 31) / 32, (ny + 31) / 32, 1);
+}
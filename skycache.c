@@ -0,0 +1,203 @@
+// Sky map cache. Decoding the 8k JPEG takes seconds, so after the first decode the texels are
+// written next to the image in the layout they are uploaded in, and later starts memory map the
+// cache and upload it, or use it directly on the CPU. The header records where the texels come
+// from and how they are stored, a cache that doesn't match the image or the requested storage is
+// written again.
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define SKY_CACHE_MAGIC 0x43594b53
+#define SKY_CACHE_VERSION 1
+
+typedef enum {
+    SKY_RGBA8,
+    SKY_SRGB8,
+    SKY_BPTC
+} SkyFormat;
+
+static const char *skyFormatNames[] = {"rgba8", "srgb", "bptc"};
+
+static bool parseSkyFormat(char *name, SkyFormat *format) {
+    for (int i=0; i<3; i++) {
+        if (!strcmp(name, skyFormatNames[i])) {
+            *format = (SkyFormat)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // Size and modification time of the image, a cache of an older image is stale.
+    int64_t sourceSize;
+    int64_t sourceTime;
+    // Size of the image.
+    int32_t width;
+    int32_t height;
+    // SkyFormat of the texels.
+    int32_t format;
+    // Face size of the cube map, 0 for the equirectangular map itself.
+    int32_t faceSize;
+    int32_t numLevels;
+    // The rows are stored bottom up, as stbi_set_flip_vertically_on_load(true) decodes them.
+    int32_t flipped;
+} SkyCacheHeader;
+
+// faceSize is the face size of the cube map, -1 for a quarter of the map width, or 0 for the
+// equirectangular map.
+static SkyCacheHeader newSkyCacheHeader(SkyFormat format, int faceSize) {
+    SkyCacheHeader header = {0};
+    header.magic = SKY_CACHE_MAGIC;
+    header.version = SKY_CACHE_VERSION;
+    header.format = format;
+    header.faceSize = faceSize;
+    header.flipped = 1;
+    return header;
+}
+
+static void skyCachePath(const char *sourcePath, SkyCacheHeader *header, char *path, int len) {
+    if (header->faceSize == 0) {
+        snprintf(path, len, "%s.%s.cache", sourcePath, skyFormatNames[header->format]);
+    } else {
+        snprintf(path, len, "%s.%s-cube.cache", sourcePath, skyFormatNames[header->format]);
+    }
+}
+
+static bool statSkySource(const char *sourcePath, SkyCacheHeader *header) {
+    struct stat info;
+    if (stat(sourcePath, &info) != 0) {
+        return false;
+    }
+    header->sourceSize = (int64_t)info.st_size;
+    header->sourceTime = (int64_t)info.st_mtime;
+    return true;
+}
+
+// Bytes of one face of a level, BPTC stores 4x4 blocks of 16 bytes.
+static size_t skyCacheImageSize(SkyCacheHeader *header, int level) {
+    int width = header->faceSize > 0 ? header->faceSize : header->width;
+    int height = header->faceSize > 0 ? header->faceSize : header->height;
+    width = width >> level > 0 ? width >> level : 1;
+    height = height >> level > 0 ? height >> level : 1;
+    if (header->format == SKY_BPTC) {
+        return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 16;
+    }
+    return (size_t)width * height * 4;
+}
+
+static size_t skyCacheDataSize(SkyCacheHeader *header) {
+    size_t size = 0;
+    for (int level=0; level<header->numLevels; level++) {
+        size += skyCacheImageSize(header, level);
+    }
+    return header->faceSize > 0 ? 6 * size : size;
+}
+
+// Maps the cache of the image at sourcePath matching header, whose remaining fields are filled in
+// from the cache. The levels follow the header, all the faces of a level after another. Returns
+// false when there is no up to date cache.
+static bool openSkyCache(const char *sourcePath, SkyCacheHeader *header, MappedFile *file) {
+    char path[1024];
+    skyCachePath(sourcePath, header, path, sizeof(path));
+    SkyCacheHeader expected = *header;
+    if (!statSkySource(sourcePath, &expected) || !mapFile(path, file)) {
+        return false;
+    }
+    SkyCacheHeader *cached = file->data;
+    bool valid = file->size >= sizeof(SkyCacheHeader) &&
+        cached->magic == expected.magic && cached->version == expected.version &&
+        cached->sourceSize == expected.sourceSize && cached->sourceTime == expected.sourceTime &&
+        cached->format == expected.format && cached->flipped == expected.flipped &&
+        (cached->faceSize == expected.faceSize || (expected.faceSize < 0 && cached->faceSize == cached->width / 4)) &&
+        file->size == sizeof(SkyCacheHeader) + skyCacheDataSize(cached);
+    if (!valid) {
+        unmapFile(file);
+        return false;
+    }
+    *header = *cached;
+    return true;
+}
+
+// The cache is written under a name of this process and renamed once complete, processes sharing
+// the image, like the workers of a render, never map one being written or truncate one mapped.
+static void skyCacheTmpPath(const char *sourcePath, SkyCacheHeader *header, char *path, int len) {
+    char cachePath[1024];
+    skyCachePath(sourcePath, header, cachePath, sizeof(cachePath));
+    snprintf(path, len, "%s.%d.tmp", cachePath, processId());
+}
+
+// Writes the header of the cache of the image at sourcePath, the levels are written to the
+// returned file in the order openSkyCache expects, then it is given to closeSkyCache. Returns NULL
+// when it can't be written, the cache is only an optimization.
+static FILE *createSkyCache(const char *sourcePath, SkyCacheHeader *header) {
+    char path[1040];
+    skyCacheTmpPath(sourcePath, header, path, sizeof(path));
+    if (!statSkySource(sourcePath, header)) {
+        return NULL;
+    }
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("Could not write the sky map cache %s\n", path);
+        return NULL;
+    }
+    fwrite(header, sizeof(*header), 1, file);
+    return file;
+}
+
+static void closeSkyCache(FILE *file, const char *sourcePath, SkyCacheHeader *header) {
+    char path[1024], tmpPath[1040];
+    skyCachePath(sourcePath, header, path, sizeof(path));
+    skyCacheTmpPath(sourcePath, header, tmpPath, sizeof(tmpPath));
+    bool written = !ferror(file);
+    written = fclose(file) == 0 && written;
+    if (!written || !replaceFile(tmpPath, path)) {
+        printf("Could not write the sky map cache %s\n", path);
+        remove(tmpPath);
+    }
+}
+
+// The texels of a sky map, from its cache or decoded from the image. Reading them needs no GL
+// context, so the viewer does it on a thread of its own while it creates the window and compiles
+// the kernels.
+typedef struct {
+    const char *path;
+    SkyCacheHeader header;
+    bool cached;
+    MappedFile cache;
+    // RGBA8, bottom row first, when there is no cache.
+    unsigned char *texels;
+    int width;
+    int height;
+} SkySource;
+
+static SkySource newSkySource(const char *path, SkyFormat format, int faceSize) {
+    SkySource source = {0};
+    source.path = path;
+    source.header = newSkyCacheHeader(format, faceSize);
+    return source;
+}
+
+// ThreadProc reading a SkySource, texels is NULL if the image can't be read.
+static void readSkySource(void *arg) {
+    SkySource *source = (SkySource *)arg;
+    source->cached = openSkyCache(source->path, &source->header, &source->cache);
+    if (source->cached) {
+        source->width = source->header.width;
+        source->height = source->header.height;
+        source->texels = (unsigned char *)source->cache.data + sizeof(SkyCacheHeader);
+    } else {
+        source->texels = decodeImage(source->path, &source->width, &source->height, getNumCores());
+    }
+}
+
+static void freeSkySource(SkySource *source) {
+    if (source->cached) {
+        unmapFile(&source->cache);
+    } else {
+        free(source->texels);
+    }
+    source->texels = NULL;
+}
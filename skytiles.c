@@ -0,0 +1,543 @@
+// Virtual-texture sky for panoramas too large for memory. The panorama is cut once into a tile file
+// holding its whole mip pyramid in fixed size tiles, of which only those the view needs are kept in
+// an atlas texture. The resolve pass looks the sky up through a page table, falling back to the
+// coarser levels of the tiles that aren't resident, and records the tiles it wanted in a feedback
+// buffer. A loader thread reads those from the file, and they are uploaded a few per frame into the
+// least recently used slots of the atlas. The coarsest levels are always resident.
+
+#define SKY_TILES_MAGIC 0x53544b53
+#define SKY_TILES_VERSION 1
+
+// Tiles are stored with a border of one texel copied from their neighbours, so that they can be
+// filtered bilinearly in the atlas.
+#define SKY_TILE_SIZE 128
+#define SKY_TILE_CONTENT (SKY_TILE_SIZE - 2)
+#define SKY_TILE_BYTES (SKY_TILE_SIZE * SKY_TILE_SIZE * 4)
+#define MAX_SKY_LEVELS 24
+
+#define SKY_PAGES_SSBO 2
+#define SKY_FEEDBACK_SSBO 3
+// Tiles recorded by the resolve pass per readback.
+#define MAX_TILE_REQUESTS 4096
+// Tiles queued to the loader, the bound on the tiles held on the CPU.
+#define SKY_TILE_QUEUE 64
+// Tiles uploaded per frame, so that a burst of them doesn't stall a frame.
+#define MAX_TILE_UPLOADS 16
+// The coarsest levels are pinned while they fit in this many tiles.
+#define MAX_PINNED_TILES 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // Size and modification time of the image, tiles of an older image are stale.
+    int64_t sourceSize;
+    int64_t sourceTime;
+    // Size of level 0, rows from the top of the panorama.
+    int32_t width;
+    int32_t height;
+    int32_t numLevels;
+    int32_t tileSize;
+} SkyTilesHeader;
+
+typedef struct {
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    // Index of the first tile of the level, levels are stored finest first.
+    int firstTile;
+} SkyTileLevel;
+
+// Fills in the levels of header, returns the number of tiles of all of them.
+static int skyTileLevels(SkyTilesHeader *header, SkyTileLevel *levels) {
+    int numTiles = 0;
+    for (int level=0; level<header->numLevels; level++) {
+        SkyTileLevel *l = &levels[level];
+        l->width = header->width >> level > 0 ? header->width >> level : 1;
+        l->height = header->height >> level > 0 ? header->height >> level : 1;
+        l->tilesX = (l->width + SKY_TILE_CONTENT - 1) / SKY_TILE_CONTENT;
+        l->tilesY = (l->height + SKY_TILE_CONTENT - 1) / SKY_TILE_CONTENT;
+        l->firstTile = numTiles;
+        numTiles += l->tilesX * l->tilesY;
+    }
+    return numTiles;
+}
+
+// Levels down to the first one that fits in a single tile.
+static int skyTileNumLevels(int width, int height) {
+    int numLevels = 1;
+    while ((width > SKY_TILE_CONTENT || height > SKY_TILE_CONTENT) && numLevels < MAX_SKY_LEVELS) {
+        width = width / 2 > 0 ? width / 2 : 1;
+        height = height / 2 > 0 ? height / 2 : 1;
+        numLevels++;
+    }
+    return numLevels;
+}
+
+static int64_t skyTileOffset(int tile) {
+    return (int64_t)sizeof(SkyTilesHeader) + (int64_t)tile * SKY_TILE_BYTES;
+}
+
+// One level being tiled. Rows come in from the top, the band holds the rows of a row of tiles with
+// the one above and below it, and pairs of rows are averaged into the next level.
+typedef struct {
+    SkyTileLevel info;
+    unsigned char *band;
+    // Image row of the first row of the band.
+    int bandStart;
+    int tileRow;
+    int nextRow;
+    unsigned char *evenRow;
+    unsigned char *downsampled;
+} SkyTileBuilder;
+
+static void writeSkyTileRow(SkyTileBuilder *builder, FILE *file, unsigned char *tile) {
+    SkyTileLevel *info = &builder->info;
+    for (int tx=0; tx<info->tilesX; tx++) {
+        for (int y=0; y<SKY_TILE_SIZE; y++) {
+            unsigned char *row = builder->band + (size_t)y * info->width * 4;
+            for (int x=0; x<SKY_TILE_SIZE; x++) {
+                // Wraps around horizontally, the rows at the poles are clamped by the band.
+                int sourceX = ((tx * SKY_TILE_CONTENT - 1 + x) % info->width + info->width) % info->width;
+                memcpy(tile + (y * SKY_TILE_SIZE + x) * 4, row + sourceX * 4, 4);
+            }
+        }
+        seekFile(file, skyTileOffset(info->firstTile + builder->tileRow * info->tilesX + tx));
+        fwrite(tile, SKY_TILE_BYTES, 1, file);
+    }
+    builder->tileRow++;
+}
+
+static void addSkyTileRow(SkyTileBuilder *builders, int level, int numLevels, unsigned char *row, FILE *file, unsigned char *tile) {
+    SkyTileBuilder *builder = &builders[level];
+    SkyTileLevel *info = &builder->info;
+    size_t rowSize = (size_t)info->width * 4;
+    int y = builder->nextRow++;
+    memcpy(builder->band + (size_t)(y - builder->bandStart) * rowSize, row, rowSize);
+    if (y == 0) {
+        // The band of the first row of tiles starts above the image.
+        memcpy(builder->band, row, rowSize);
+    }
+    if (y == info->height - 1) {
+        for (int r=y - builder->bandStart + 1; r<SKY_TILE_SIZE; r++) {
+            memcpy(builder->band + r * rowSize, row, rowSize);
+        }
+    }
+    while (builder->tileRow < info->tilesY && (y - builder->bandStart == SKY_TILE_SIZE - 1 || y == info->height - 1)) {
+        writeSkyTileRow(builder, file, tile);
+        // The last two rows are the first two of the next band.
+        memmove(builder->band, builder->band + SKY_TILE_CONTENT * rowSize, 2 * rowSize);
+        builder->bandStart += SKY_TILE_CONTENT;
+        if (y != info->height - 1 || builder->tileRow == info->tilesY) {
+            break;
+        }
+        for (int r=y - builder->bandStart + 1; r<SKY_TILE_SIZE; r++) {
+            memcpy(builder->band + r * rowSize, row, rowSize);
+        }
+    }
+
+    if (level + 1 == numLevels) {
+        return;
+    }
+    // Box filter into the next level, an odd last row is dropped like the last row of a GL mip level.
+    bool single = info->height == 1;
+    if (y % 2 == 0 && !single) {
+        memcpy(builder->evenRow, row, rowSize);
+        return;
+    }
+    unsigned char *above = single ? row : builder->evenRow;
+    SkyTileLevel *next = &builders[level + 1].info;
+    for (int x=0; x<next->width; x++) {
+        int x0 = 2 * x < info->width ? 2 * x : info->width - 1;
+        int x1 = 2 * x + 1 < info->width ? 2 * x + 1 : info->width - 1;
+        for (int c=0; c<4; c++) {
+            int sum = above[x0 * 4 + c] + above[x1 * 4 + c] + row[x0 * 4 + c] + row[x1 * 4 + c];
+            builder->downsampled[x * 4 + c] = (unsigned char)((sum + 2) / 4);
+        }
+    }
+    addSkyTileRow(builders, level + 1, numLevels, builder->downsampled, file, tile);
+}
+
+// Cuts the image at sourcePath into the tile file at path, a band of rows at a time so that only
+// rows of the image are ever in memory. Returns false if the image can't be read. Tiling takes
+// minutes for the largest panoramas, the file is written under a name of this process and renamed
+// once complete so that an interrupted run leaves nothing to be taken for tiles.
+static bool buildSkyTiles(const char *sourcePath, const char *path) {
+    ImageRows rows;
+    if (!openImageRows(&rows, sourcePath, getNumCores())) {
+        return false;
+    }
+    SkyCacheHeader source;
+    statSkySource(sourcePath, &source);
+    SkyTilesHeader header = {0};
+    header.magic = SKY_TILES_MAGIC;
+    header.version = SKY_TILES_VERSION;
+    header.sourceSize = source.sourceSize;
+    header.sourceTime = source.sourceTime;
+    header.width = rows.width;
+    header.height = rows.height;
+    header.numLevels = skyTileNumLevels(rows.width, rows.height);
+    header.tileSize = SKY_TILE_SIZE;
+    char tmpPath[1040];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, processId());
+    FILE *file = fopen(tmpPath, "wb");
+    if (!file) {
+        printf("Could not write the sky tiles %s\n", tmpPath);
+        exit(-1);
+    }
+    fwrite(&header, sizeof(header), 1, file);
+
+    SkyTileLevel levels[MAX_SKY_LEVELS];
+    skyTileLevels(&header, levels);
+    SkyTileBuilder builders[MAX_SKY_LEVELS] = {0};
+    for (int level=0; level<header.numLevels; level++) {
+        SkyTileBuilder *builder = &builders[level];
+        builder->info = levels[level];
+        builder->band = malloc((size_t)SKY_TILE_SIZE * builder->info.width * 4);
+        builder->bandStart = -1;
+        builder->evenRow = malloc((size_t)builder->info.width * 4);
+        builder->downsampled = malloc((size_t)builder->info.width * 4);
+    }
+    unsigned char *tile = malloc(SKY_TILE_BYTES);
+    bool complete = true;
+    for (int y=0; y<header.height; y++) {
+        unsigned char *row = nextImageRow(&rows);
+        if (!row) {
+            complete = false;
+            break;
+        }
+        addSkyTileRow(builders, 0, header.numLevels, row, file, tile);
+    }
+    free(tile);
+    for (int level=0; level<header.numLevels; level++) {
+        free(builders[level].band);
+        free(builders[level].evenRow);
+        free(builders[level].downsampled);
+    }
+    closeImageRows(&rows);
+    bool written = !ferror(file);
+    written = fclose(file) == 0 && written;
+    if (!written || (complete && !replaceFile(tmpPath, path))) {
+        printf("Could not write the sky tiles %s\n", path);
+        exit(-1);
+    } else if (!complete) {
+        remove(tmpPath);
+    }
+    return complete;
+}
+
+// The tile file of a panorama, opened on a thread of its own like SkySource since the tiles are
+// built first when they are missing or stale.
+typedef struct {
+    const char *sourcePath;
+    FILE *file;
+    SkyTilesHeader header;
+} SkyTileFile;
+
+static bool readSkyTilesHeader(SkyTileFile *tileFile, const char *path) {
+    SkyCacheHeader source;
+    tileFile->file = fopen(path, "rb");
+    if (!tileFile->file) {
+        return false;
+    }
+    SkyTilesHeader *header = &tileFile->header;
+    bool valid = fread(header, sizeof(*header), 1, tileFile->file) == 1 && statSkySource(tileFile->sourcePath, &source) &&
+        header->magic == SKY_TILES_MAGIC && header->version == SKY_TILES_VERSION &&
+        header->sourceSize == source.sourceSize && header->sourceTime == source.sourceTime &&
+        header->tileSize == SKY_TILE_SIZE && header->numLevels > 0 && header->numLevels <= MAX_SKY_LEVELS;
+    if (valid) {
+        // A file cut short would hand out black tiles or fail to read them.
+        SkyTileLevel levels[MAX_SKY_LEVELS];
+        valid = fileSize(path) == skyTileOffset(skyTileLevels(header, levels));
+    }
+    if (!valid) {
+        fclose(tileFile->file);
+        tileFile->file = NULL;
+    }
+    return valid;
+}
+
+// ThreadProc opening a SkyTileFile, file is NULL if the panorama can't be read.
+static void openSkyTileFile(void *arg) {
+    SkyTileFile *tileFile = (SkyTileFile *)arg;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s.tiles", tileFile->sourcePath);
+    if (readSkyTilesHeader(tileFile, path)) {
+        return;
+    }
+    printf("Tiling %s\n", tileFile->sourcePath);
+    if (buildSkyTiles(tileFile->sourcePath, path)) {
+        readSkyTilesHeader(tileFile, path);
+    }
+}
+
+static void readSkyTile(SkyTileFile *tileFile, int tile, unsigned char *texels) {
+    if (!seekFile(tileFile->file, skyTileOffset(tile)) || fread(texels, SKY_TILE_BYTES, 1, tileFile->file) != 1) {
+        printf("Could not read sky tile %d\n", tile);
+        exit(-1);
+    }
+}
+
+// Tiles queued to the loader thread. The main thread queues tiles at requested and takes them back
+// read at uploaded, the loader reads them at loaded, each index only moved by one thread.
+typedef struct {
+    SkyTileFile *tileFile;
+    int tiles[SKY_TILE_QUEUE];
+    unsigned char *texels;
+    volatile int requested;
+    volatile int loaded;
+    volatile int uploaded;
+    volatile int quit;
+} SkyTileLoader;
+
+static void loadSkyTiles(void *arg) {
+    SkyTileLoader *loader = (SkyTileLoader *)arg;
+    while (!atomicFetchAdd(&loader->quit, 0)) {
+        if (loader->loaded == atomicFetchAdd(&loader->requested, 0)) {
+            sleepMilliseconds(1);
+            continue;
+        }
+        int entry = loader->loaded % SKY_TILE_QUEUE;
+        readSkyTile(loader->tileFile, loader->tiles[entry], loader->texels + (size_t)entry * SKY_TILE_BYTES);
+        atomicFetchAdd(&loader->loaded, 1);
+    }
+}
+
+// The page table as laid out in the SSBO, followed by the slot + 1 of each tile, 0 when it isn't
+// resident.
+typedef struct {
+    // width, height, tilesX and firstTile of each level.
+    GLint levels[MAX_SKY_LEVELS][4];
+    GLint numLevels;
+    GLint atlasTiles;
+} SkyPagesHeader;
+
+typedef struct {
+    SkyTileFile *tileFile;
+    SkyTileLevel levels[MAX_SKY_LEVELS];
+    int numTiles;
+    // The atlas is atlasTiles x atlasTiles slots.
+    int atlasTiles;
+    int numSlots;
+    int numPinnedSlots;
+    GLuint atlasId;
+    GLuint pagesId;
+    GLuint feedbackId;
+    GLuint readbackId;
+    GLsync readbackFence;
+    // Slot of each tile, -1 when it isn't resident, and tile of each slot, -1 when it is free.
+    int *tileSlots;
+    int *slotTiles;
+    // Frame each slot was last wanted in.
+    int *slotFrames;
+    bool *tilePending;
+    GLuint *requests;
+    // The last readback wanted tiles that aren't resident.
+    bool missing;
+    int frame;
+    SkyTileLoader loader;
+    Thread loaderThread;
+} SkyTiles;
+
+static void uploadSkyTile(SkyTiles *tiles, int tile, int slot, unsigned char *texels) {
+    int evicted = tiles->slotTiles[slot];
+    glBindBuffer(GL_COPY_WRITE_BUFFER, tiles->pagesId);
+    if (evicted >= 0) {
+        GLuint notResident = 0;
+        tiles->tileSlots[evicted] = -1;
+        glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(SkyPagesHeader) + evicted * sizeof(GLuint), sizeof(GLuint), &notResident);
+    }
+    glActiveTexture(GL_TEXTURE0 + SKY_MAP_UNIT);
+    glBindTexture(GL_TEXTURE_2D, tiles->atlasId);
+    int x = slot % tiles->atlasTiles * SKY_TILE_SIZE;
+    int y = slot / tiles->atlasTiles * SKY_TILE_SIZE;
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, SKY_TILE_SIZE, SKY_TILE_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, texels);
+    GLuint page = slot + 1;
+    glBufferSubData(GL_COPY_WRITE_BUFFER, sizeof(SkyPagesHeader) + tile * sizeof(GLuint), sizeof(GLuint), &page);
+    tiles->tileSlots[tile] = slot;
+    tiles->slotTiles[slot] = tile;
+    tiles->slotFrames[slot] = tiles->frame;
+}
+
+// Sets up the atlas of atlasTiles x atlasTiles tiles for the opened tileFile, uploads the pinned
+// levels and starts the loader.
+static SkyTiles initSkyTiles(SkyTileFile *tileFile, int atlasTiles, SkyFormat format) {
+    if (!tileFile->file) {
+        printf("Could not load sky map %s\n", tileFile->sourcePath);
+        exit(-1);
+    }
+    SkyTiles tiles = {0};
+    tiles.tileFile = tileFile;
+    tiles.numTiles = skyTileLevels(&tileFile->header, tiles.levels);
+    GLint maxSize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    tiles.atlasTiles = atlasTiles * SKY_TILE_SIZE <= maxSize ? atlasTiles : maxSize / SKY_TILE_SIZE;
+    tiles.numSlots = tiles.atlasTiles * tiles.atlasTiles;
+    tiles.tileSlots = malloc(tiles.numTiles * sizeof(int));
+    tiles.slotTiles = malloc(tiles.numSlots * sizeof(int));
+    tiles.slotFrames = calloc(tiles.numSlots, sizeof(int));
+    tiles.tilePending = calloc(tiles.numTiles, sizeof(bool));
+    tiles.requests = malloc((MAX_TILE_REQUESTS + 1) * sizeof(GLuint));
+    memset(tiles.tileSlots, -1, tiles.numTiles * sizeof(int));
+    memset(tiles.slotTiles, -1, tiles.numSlots * sizeof(int));
+
+    // The atlas takes the place of the equirectangular map.
+    tiles.atlasId = newSkyTexture(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    GLenum internalFormat = format == SKY_SRGB8 ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+    glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, tiles.atlasTiles * SKY_TILE_SIZE, tiles.atlasTiles * SKY_TILE_SIZE);
+
+    SkyPagesHeader pagesHeader = {0};
+    int numLevels = tileFile->header.numLevels;
+    for (int level=0; level<numLevels; level++) {
+        SkyTileLevel *l = &tiles.levels[level];
+        pagesHeader.levels[level][0] = l->width;
+        pagesHeader.levels[level][1] = l->height;
+        pagesHeader.levels[level][2] = l->tilesX;
+        pagesHeader.levels[level][3] = l->firstTile;
+    }
+    pagesHeader.numLevels = numLevels;
+    pagesHeader.atlasTiles = tiles.atlasTiles;
+    size_t pagesSize = sizeof(SkyPagesHeader) + tiles.numTiles * sizeof(GLuint);
+    glGenBuffers(1, &tiles.pagesId);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, tiles.pagesId);
+    glBufferData(GL_COPY_WRITE_BUFFER, pagesSize, NULL, GL_DYNAMIC_DRAW);
+    GLuint zero = 0;
+    glClearBufferData(GL_COPY_WRITE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, 0, sizeof(pagesHeader), &pagesHeader);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SKY_PAGES_SSBO, tiles.pagesId);
+
+    // The number of requests, the requests and a flag per tile so that each is requested once.
+    glGenBuffers(1, &tiles.feedbackId);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, tiles.feedbackId);
+    glBufferData(GL_COPY_WRITE_BUFFER, (1 + MAX_TILE_REQUESTS + tiles.numTiles) * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glClearBufferData(GL_COPY_WRITE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SKY_FEEDBACK_SSBO, tiles.feedbackId);
+    glGenBuffers(1, &tiles.readbackId);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, tiles.readbackId);
+    glBufferData(GL_COPY_WRITE_BUFFER, (1 + MAX_TILE_REQUESTS) * sizeof(GLuint), NULL, GL_STREAM_READ);
+
+    // Pinned levels, from the coarsest one, are never evicted.
+    unsigned char *texels = malloc(SKY_TILE_BYTES);
+    for (int level=numLevels - 1; level>=0; level--) {
+        SkyTileLevel *l = &tiles.levels[level];
+        int numLevelTiles = l->tilesX * l->tilesY;
+        if (tiles.numPinnedSlots + numLevelTiles > MAX_PINNED_TILES && level != numLevels - 1) {
+            break;
+        }
+        if (tiles.numPinnedSlots + numLevelTiles >= tiles.numSlots) {
+            printf("The sky atlas is too small\n");
+            exit(-1);
+        }
+        for (int tile=l->firstTile; tile<l->firstTile + numLevelTiles; tile++) {
+            readSkyTile(tileFile, tile, texels);
+            uploadSkyTile(&tiles, tile, tiles.numPinnedSlots++, texels);
+        }
+    }
+    free(texels);
+
+    tiles.loader.tileFile = tileFile;
+    tiles.loader.texels = malloc((size_t)SKY_TILE_QUEUE * SKY_TILE_BYTES);
+    return tiles;
+}
+
+// The loader keeps pointers into tiles, it is started once tiles is where it stays.
+static void startSkyTileLoader(SkyTiles *tiles) {
+    startThread(&tiles->loaderThread, loadSkyTiles, &tiles->loader);
+}
+
+static void stopSkyTileLoader(SkyTiles *tiles) {
+    atomicFetchAdd(&tiles->loader.quit, 1);
+    joinThread(&tiles->loaderThread);
+}
+
+static int compareTilesCoarseFirst(const void *a, const void *b) {
+    GLuint x = *(const GLuint *)a, y = *(const GLuint *)b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// The least recently wanted slot that isn't pinned, -1 when all of them were wanted this frame.
+static int skyTileVictim(SkyTiles *tiles) {
+    int victim = -1;
+    for (int slot=tiles->numPinnedSlots; slot<tiles->numSlots; slot++) {
+        if (tiles->slotTiles[slot] < 0) {
+            return slot;
+        }
+        if (tiles->slotFrames[slot] < tiles->frame && (victim < 0 || tiles->slotFrames[slot] < tiles->slotFrames[victim])) {
+            victim = slot;
+        }
+    }
+    return victim;
+}
+
+// Queues the tiles the last read back resolve pass wanted and uploads the tiles loaded since the
+// last frame. Returns true when tiles were uploaded, the sky has to be resolved again.
+static bool updateSkyTiles(SkyTiles *tiles) {
+    tiles->frame++;
+    SkyTileLoader *loader = &tiles->loader;
+    if (tiles->readbackFence && glClientWaitSync(tiles->readbackFence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+        glDeleteSync(tiles->readbackFence);
+        tiles->readbackFence = 0;
+        glBindBuffer(GL_COPY_READ_BUFFER, tiles->readbackId);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, (1 + MAX_TILE_REQUESTS) * sizeof(GLuint), tiles->requests);
+        int numRequests = tiles->requests[0] < MAX_TILE_REQUESTS ? (int)tiles->requests[0] : MAX_TILE_REQUESTS;
+        GLuint *requests = tiles->requests + 1;
+        // Coarser levels first, they are what the view falls back to.
+        qsort(requests, numRequests, sizeof(GLuint), compareTilesCoarseFirst);
+        tiles->missing = false;
+        for (int i=0; i<numRequests; i++) {
+            int tile = (int)requests[i];
+            if (tile >= tiles->numTiles) {
+                continue;
+            }
+            if (tiles->tileSlots[tile] >= 0) {
+                tiles->slotFrames[tiles->tileSlots[tile]] = tiles->frame;
+                continue;
+            }
+            tiles->missing = true;
+            if (!tiles->tilePending[tile] && loader->requested - loader->uploaded < SKY_TILE_QUEUE) {
+                loader->tiles[loader->requested % SKY_TILE_QUEUE] = tile;
+                tiles->tilePending[tile] = true;
+                atomicFetchAdd(&loader->requested, 1);
+            }
+        }
+    }
+
+    int numUploads = 0;
+    int loaded = atomicFetchAdd(&loader->loaded, 0);
+    while (loader->uploaded < loaded && numUploads < MAX_TILE_UPLOADS) {
+        int entry = loader->uploaded % SKY_TILE_QUEUE;
+        int tile = loader->tiles[entry];
+        int slot = skyTileVictim(tiles);
+        if (slot < 0) {
+            // Everything resident is in view, the tile waits until something isn't.
+            break;
+        }
+        uploadSkyTile(tiles, tile, slot, loader->texels + (size_t)entry * SKY_TILE_BYTES);
+        tiles->tilePending[tile] = false;
+        atomicFetchAdd(&loader->uploaded, 1);
+        numUploads++;
+    }
+    return numUploads > 0;
+}
+
+// Reads back the tiles wanted by the resolve passes so far, unless the last readback is still in
+// flight, and clears the feedback for the next ones.
+static void readSkyTileFeedback(SkyTiles *tiles) {
+    if (tiles->readbackFence) {
+        return;
+    }
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, tiles->feedbackId);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, tiles->readbackId);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (1 + MAX_TILE_REQUESTS) * sizeof(GLuint));
+    GLuint zero = 0;
+    glClearBufferData(GL_COPY_READ_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    tiles->readbackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Tiles are still on their way, the view isn't final.
+static bool skyTilesLoading(SkyTiles *tiles) {
+    return tiles->missing || tiles->loader.requested != tiles->loader.uploaded;
+}
@@ -0,0 +1,118 @@
+// Buffers rewritten by the CPU every frame. Each one holds STREAM_FRAMES copies of its contents used
+// in turn, with a fence per copy, so the next frame is written while the GPU still reads the last
+// ones instead of glBufferSubData waiting for it. With GL_ARB_buffer_storage (core in 4.4, the
+// context asks for 4.3) the buffer stays mapped persistently and coherently, otherwise each copy is
+// mapped unsynchronized once its fence has passed.
+
+#define STREAM_FRAMES 3
+
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+static PFNGLBUFFERSTORAGEPROC bufferStorage;
+
+typedef struct {
+    GLuint id;
+    GLenum target;
+    // Bytes of each copy, the binding offsets stay aligned.
+    GLsizeiptr frameSize;
+    // The persistent mapping, NULL without buffer storage.
+    unsigned char *mapped;
+    GLsync fences[STREAM_FRAMES];
+    int frame;
+} StreamBuffer;
+
+// Call once the context is current, with the loader given to glad.
+static void loadBufferStorage(GLADloadproc load) {
+    if (GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 4) || glExtensionSupported("GL_ARB_buffer_storage")) {
+        bufferStorage = (PFNGLBUFFERSTORAGEPROC)load("glBufferStorage");
+    }
+}
+
+// size bytes per frame, binding offsets are multiples of alignment.
+static StreamBuffer initStreamBuffer(GLenum target, GLsizeiptr size, GLint alignment) {
+    StreamBuffer buffer = {0};
+    buffer.target = target;
+    buffer.frameSize = (size + alignment - 1) / alignment * alignment;
+    glGenBuffers(1, &buffer.id);
+    glBindBuffer(target, buffer.id);
+    if (bufferStorage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(target, STREAM_FRAMES * buffer.frameSize, NULL, flags);
+        buffer.mapped = glMapBufferRange(target, 0, STREAM_FRAMES * buffer.frameSize, flags);
+    } else {
+        glBufferData(target, STREAM_FRAMES * buffer.frameSize, NULL, GL_STREAM_DRAW);
+    }
+    return buffer;
+}
+
+// Offset of the copy written this frame.
+static GLintptr streamOffset(StreamBuffer *buffer) {
+    return buffer->frame * buffer->frameSize;
+}
+
+// Returns where this frame's contents go. Only waits when the GPU is STREAM_FRAMES frames behind.
+// Binds the buffer to its target.
+static void* beginStreamWrite(StreamBuffer *buffer) {
+    GLsync fence = buffer->fences[buffer->frame];
+    if (fence) {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fence);
+        buffer->fences[buffer->frame] = 0;
+    }
+    glBindBuffer(buffer->target, buffer->id);
+    if (buffer->mapped) {
+        return buffer->mapped + streamOffset(buffer);
+    }
+    // The fence passed, nothing reads this copy anymore.
+    GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+    return glMapBufferRange(buffer->target, streamOffset(buffer), buffer->frameSize, access);
+}
+
+// The buffer has to be bound to its target, as left by beginStreamWrite.
+static void endStreamWrite(StreamBuffer *buffer) {
+    if (!buffer->mapped) {
+        glUnmapBuffer(buffer->target);
+    }
+}
+
+// Call after the last command reading this frame's copy, the next frame writes the next one.
+static void endStreamFrame(StreamBuffer *buffer) {
+    buffer->fences[buffer->frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    buffer->frame = (buffer->frame + 1) % STREAM_FRAMES;
+}
+
+// Buffers only ever appended to. A draw in flight never reads what is appended after it, so there
+// are no copies and nothing waits.
+typedef struct {
+    GLuint id;
+    GLenum target;
+    unsigned char *mapped;
+} AppendBuffer;
+
+static AppendBuffer initAppendBuffer(GLenum target, GLsizeiptr size) {
+    AppendBuffer buffer = {0};
+    buffer.target = target;
+    glGenBuffers(1, &buffer.id);
+    glBindBuffer(target, buffer.id);
+    if (bufferStorage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        bufferStorage(target, size, NULL, flags);
+        buffer.mapped = glMapBufferRange(target, 0, size, flags);
+    } else {
+        glBufferData(target, size, NULL, GL_DYNAMIC_DRAW);
+    }
+    return buffer;
+}
+
+// Writes size bytes at offset, which no draw has read yet.
+static void appendToBuffer(AppendBuffer *buffer, GLintptr offset, const void *data, GLsizeiptr size) {
+    if (buffer->mapped) {
+        memcpy(buffer->mapped + offset, data, size);
+        return;
+    }
+    glBindBuffer(buffer->target, buffer->id);
+    GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+    memcpy(glMapBufferRange(buffer->target, offset, size, access), data, size);
+    glUnmapBuffer(buffer->target);
+}
@@ -0,0 +1,142 @@
+// Minimal threading layer, Win32 threads on Windows and pthreads everywhere else.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define MAX_THREADS 256
+
+typedef void (*ThreadProc)(void *arg);
+
+typedef struct {
+    ThreadProc proc;
+    void *arg;
+} ThreadStart;
+
+static int getNumCores() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+    return numCores > 0 ? (int)numCores : 1;
+#endif
+}
+
+// Returns the value before the increment.
+static inline int atomicFetchAdd(volatile int *value, int amount) {
+#ifdef _WIN32
+    return InterlockedExchangeAdd((volatile LONG *)value, amount);
+#else
+    return __sync_fetch_and_add(value, amount);
+#endif
+}
+
+// Returns the value it replaced.
+static inline int atomicExchange(volatile int *value, int newValue) {
+#ifdef _WIN32
+    return InterlockedExchange((volatile LONG *)value, newValue);
+#else
+    return __atomic_exchange_n(value, newValue, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static void sleepMilliseconds(int milliseconds) {
+#ifdef _WIN32
+    Sleep(milliseconds);
+#else
+    struct timespec duration = {milliseconds / 1000, (milliseconds % 1000) * 1000000L};
+    nanosleep(&duration, NULL);
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI threadEntry(LPVOID param) {
+    ThreadStart *start = (ThreadStart *)param;
+    start->proc(start->arg);
+    return 0;
+}
+#else
+static void *threadEntry(void *param) {
+    ThreadStart *start = (ThreadStart *)param;
+    start->proc(start->arg);
+    return NULL;
+}
+#endif
+
+// Runs proc(arg) on numThreads threads (the calling thread being one of them) and waits for all of them.
+static void runThreads(int numThreads, ThreadProc proc, void *arg) {
+    if (numThreads > MAX_THREADS) {
+        numThreads = MAX_THREADS;
+    }
+    ThreadStart start;
+    start.proc = proc;
+    start.arg = arg;
+#ifdef _WIN32
+    HANDLE threads[MAX_THREADS];
+    for (int i=1; i<numThreads; i++) {
+        threads[i] = CreateThread(NULL, 0, threadEntry, &start, 0, NULL);
+        if (!threads[i]) {
+            printf("Could not create thread\n");
+            exit(-1);
+        }
+    }
+    proc(arg);
+    for (int i=1; i<numThreads; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    pthread_t threads[MAX_THREADS];
+    for (int i=1; i<numThreads; i++) {
+        if (pthread_create(&threads[i], NULL, threadEntry, &start) != 0) {
+            printf("Could not create thread\n");
+            exit(-1);
+        }
+    }
+    proc(arg);
+    for (int i=1; i<numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#endif
+}
+
+// A thread running in the background until joined.
+typedef struct {
+    ThreadStart start;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} Thread;
+
+// Starts proc(arg) on a new thread, thread must stay valid until joinThread.
+static void startThread(Thread *thread, ThreadProc proc, void *arg) {
+    thread->start.proc = proc;
+    thread->start.arg = arg;
+#ifdef _WIN32
+    thread->handle = CreateThread(NULL, 0, threadEntry, &thread->start, 0, NULL);
+    bool created = thread->handle != NULL;
+#else
+    bool created = pthread_create(&thread->handle, NULL, threadEntry, &thread->start) == 0;
+#endif
+    if (!created) {
+        printf("Could not create thread\n");
+        exit(-1);
+    }
+}
+
+static void joinThread(Thread *thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    pthread_join(thread->handle, NULL);
+#endif
+}
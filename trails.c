@@ -0,0 +1,256 @@
+// Bundles of test photons and massive particles fired from the eye, integrated together on the CPU
+// with the Verlet scheme of the laser, or with RK45 and a step size per trail when the kernels use
+// it. The state is kept in structure of arrays form and the Verlet loop is branch-free over
+// restrict pointers, so it vectorizes where sqrtf need not set errno (MSVC /O2, gcc and clang with
+// -fno-math-errno). Trails advance at a fixed rate of steps per simulation tick whatever the frame
+// rate. The simulation thread queues the positions of all the trails after every step, the render
+// thread appends them to a GPU buffer, step after step, and shaders/trail.vs draws each trail as an
+// instance of a line strip reading its points from there.
+
+#define TRAILS_SSBO 4
+// Steps queued for the render thread, the simulation holds the trails when it is this far behind.
+#define TRAIL_QUEUE 256
+// Golden angle, spreads the directions of a bundle evenly over its cone.
+#define TRAIL_SPIRAL_ANGLE 2.39996323f
+
+typedef struct {
+    // Positions of every trail after each queued step, interleaved, TRAIL_QUEUE entries.
+    float *points;
+    // The entry starts a new bundle.
+    bool launches[TRAIL_QUEUE];
+    volatile int queued;
+    volatile int uploaded;
+} TrailQueue;
+
+// The simulation thread owns the integration state, the render thread the GPU side.
+typedef struct {
+    int numTrails;
+    // The trails past numPhotons are massive particles.
+    int numPhotons;
+    // Points per trail, the same for all of them.
+    int maxPoints;
+    // Points queued since the launch.
+    int numPoints;
+    float *x, *y, *z;
+    float *vx, *vy, *vz;
+    float *h2;
+    // Next step size of every trail with RK45, like Photon.step.
+    float *step;
+    // 0 for photons, 1 for massive particles.
+    float *mass;
+    // 1 while the trail is between the disc inner radius and the sky, then 0.
+    float *moving;
+    // Half angle of the cone, in radians, and initial speed of the massive particles.
+    float spread;
+    float speed;
+    float minR;
+    float maxR;
+    // Steps per tick since launchTick.
+    double rate;
+    int launchTick;
+    TrailQueue queue;
+    // Points appended to buffer since the launch.
+    int numUploaded;
+    AppendBuffer buffer;
+    GLuint programId;
+    GLint viewProjectionLocation;
+    GLint numTrailsLocation;
+    GLint numPhotonsLocation;
+} Trails;
+
+// rate is in steps per tick.
+static Trails initTrails(int numPhotons, int numParticles, int maxPoints, float spreadDegrees, float speed, double rate, float minR, float maxR) {
+    Trails trails = {0};
+    trails.numTrails = numPhotons + numParticles;
+    trails.numPhotons = numPhotons;
+    trails.maxPoints = maxPoints;
+    trails.spread = spreadDegrees * PI / 180.0f;
+    trails.speed = speed;
+    trails.minR = minR;
+    trails.maxR = maxR;
+    trails.rate = rate;
+    float **arrays[] = {&trails.x, &trails.y, &trails.z, &trails.vx, &trails.vy, &trails.vz, &trails.h2, &trails.step, &trails.mass, &trails.moving};
+    for (int i=0; i<(int)(sizeof(arrays) / sizeof(arrays[0])); i++) {
+        *arrays[i] = calloc(trails.numTrails, sizeof(float));
+    }
+    trails.queue.points = calloc(3 * (size_t)trails.numTrails * TRAIL_QUEUE, sizeof(float));
+    trails.buffer = initAppendBuffer(GL_SHADER_STORAGE_BUFFER, 3 * (GLsizeiptr)trails.numTrails * maxPoints * sizeof(float));
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TRAILS_SSBO, trails.buffer.id);
+
+    GLuint vsShaderId = shaderFromSource("trailVs", GL_VERTEX_SHADER, "shaders/trail.vs");
+    GLuint fsShaderId = shaderFromSource("trailFs", GL_FRAGMENT_SHADER, "shaders/trail.fs");
+    trails.programId = shaderProgramFromShaders(vsShaderId, fsShaderId);
+    trails.viewProjectionLocation = glGetUniformLocation(trails.programId, "viewProjection");
+    trails.numTrailsLocation = glGetUniformLocation(trails.programId, "numTrails");
+    trails.numPhotonsLocation = glGetUniformLocation(trails.programId, "numPhotons");
+    return trails;
+}
+
+static bool trailQueueFull(Trails *trails) {
+    return trails->queue.queued - atomicFetchAdd(&trails->queue.uploaded, 0) == TRAIL_QUEUE;
+}
+
+static void queueTrailPoints(Trails *trails) {
+    TrailQueue *queue = &trails->queue;
+    int entry = queue->queued % TRAIL_QUEUE;
+    float *points = queue->points + 3 * (size_t)trails->numTrails * entry;
+    for (int i=0; i<trails->numTrails; i++) {
+        points[3*i] = trails->x[i];
+        points[3*i + 1] = trails->y[i];
+        points[3*i + 2] = trails->z[i];
+    }
+    queue->launches[entry] = trails->numPoints == 0;
+    trails->numPoints++;
+    atomicFetchAdd(&queue->queued, 1);
+}
+
+// Fires the bundles from origin in a cone around front, right and up completing the basis. The
+// first photon and the first particle go straight along front. Their first points are queued by
+// advanceTrails.
+static void launchTrails(Trails *trails, v3 origin, v3 front, v3 right, v3 up, int tick) {
+    for (int i=0; i<trails->numTrails; i++) {
+        bool photon = i < trails->numPhotons;
+        int index = photon ? i : i - trails->numPhotons;
+        int count = photon ? trails->numPhotons : trails->numTrails - trails->numPhotons;
+        float radius = tanf(trails->spread * sqrtf((float)index / count));
+        float angle = TRAIL_SPIRAL_ANGLE * index;
+        v3 offset = addV3(mulV3(radius * cosf(angle), right), mulV3(radius * sinf(angle), up));
+        v3 direction = mulV3(photon ? 1.0f : trails->speed, normalizeV3(addV3(front, offset)));
+        v3 crossed = crossV3(origin, direction);
+        trails->x[i] = origin.x;
+        trails->y[i] = origin.y;
+        trails->z[i] = origin.z;
+        trails->vx[i] = direction.x;
+        trails->vy[i] = direction.y;
+        trails->vz[i] = direction.z;
+        trails->h2[i] = dotV3(crossed, crossed);
+        trails->step[i] = STEP;
+        trails->mass[i] = photon ? 0.0f : 1.0f;
+        trails->moving[i] = 1.0f;
+    }
+    trails->numPoints = 0;
+    trails->launchTick = tick;
+}
+
+// One Verlet step of every trail, with the step size of the laser. Massive particles also feel the
+// Newtonian pull, M = 1/2 with the horizon at r = 1. Stopped trails repeat their last point.
+// The arrays are passed as restrict parameters, which the compilers keep through inlining, unlike
+// restrict locals.
+static void stepTrailArrays(int numTrails, float minR2, float maxR2, float *restrict x, float *restrict y, float *restrict z,
+                            float *restrict vx, float *restrict vy, float *restrict vz, const float *restrict h2,
+                            const float *restrict mass, float *restrict moving) {
+    for (int i=0; i<numTrails; i++) {
+        float sqrNorm = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+        float step = moving[i] * 0.1f * (1.0f - 1.0f / sqrtf(sqrNorm));
+        x[i] += step * vx[i];
+        y[i] += step * vy[i];
+        z[i] += step * vz[i];
+        sqrNorm = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+        float invR = 1.0f / sqrtf(sqrNorm);
+        float invR3 = invR * invR * invR;
+        float accel = potentialCoef * h2[i] * invR3 * invR * invR - 0.5f * mass[i] * invR3;
+        vx[i] += step * accel * x[i];
+        vy[i] += step * accel * y[i];
+        vz[i] += step * accel * z[i];
+        // Both comparisons are evaluated, a select rather than a branch.
+        moving[i] = (sqrNorm > minR2) & (sqrNorm < maxR2) ? moving[i] : 0.0f;
+    }
+}
+
+// One accepted rk45Step of every moving trail, each with its own step size.
+static void stepTrailsRk45(Trails *trails) {
+    float minR2 = trails->minR * trails->minR;
+    float maxR2 = trails->maxR * trails->maxR;
+    for (int i=0; i<trails->numTrails; i++) {
+        if (trails->moving[i] == 0.0f) {
+            continue;
+        }
+        Photon photon = {
+            .point = newV3(trails->x[i], trails->y[i], trails->z[i]),
+            .velocity = newV3(trails->vx[i], trails->vy[i], trails->vz[i]),
+            .h2 = trails->h2[i],
+            .mass = trails->mass[i],
+            .step = trails->step[i],
+        };
+        rk45Step(&photon, DEFAULT_RK45_TOLERANCE);
+        trails->x[i] = photon.point.x;
+        trails->y[i] = photon.point.y;
+        trails->z[i] = photon.point.z;
+        trails->vx[i] = photon.velocity.x;
+        trails->vy[i] = photon.velocity.y;
+        trails->vz[i] = photon.velocity.z;
+        trails->step[i] = photon.step;
+        float sqrNorm = dotV3(photon.point, photon.point);
+        trails->moving[i] = sqrNorm > minR2 && sqrNorm < maxR2 ? 1.0f : 0.0f;
+    }
+}
+
+// The trails follow the integrator of the kernels, Binet has no 3D state and uses Verlet.
+static void stepTrails(Trails *trails, int integrator) {
+    if (integrator == INTEGRATOR_RK45) {
+        stepTrailsRk45(trails);
+    } else {
+        stepTrailArrays(trails->numTrails, trails->minR * trails->minR, trails->maxR * trails->maxR, trails->x, trails->y,
+                        trails->z, trails->vx, trails->vy, trails->vz, trails->h2, trails->mass, trails->moving);
+    }
+}
+
+static bool trailsMoving(Trails *trails) {
+    if (trails->numPoints >= trails->maxPoints) {
+        return false;
+    }
+    for (int i=0; i<trails->numTrails; i++) {
+        if (trails->moving[i] != 0.0f) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes and queues the steps due at tick, on the simulation thread. The steps wait while the queue
+// is full, the trails are the same whenever they are drawn.
+static void advanceTrails(Trails *trails, int tick, int integrator) {
+    if (trails->numPoints == 0 && !trailQueueFull(trails)) {
+        queueTrailPoints(trails);
+    }
+    while (trails->numPoints - 1 < (tick - trails->launchTick) * trails->rate && trailsMoving(trails) && !trailQueueFull(trails)) {
+        stepTrails(trails, integrator);
+        queueTrailPoints(trails);
+    }
+}
+
+// Appends the queued steps to the GPU buffer, on the render thread. Returns true when there were any.
+static bool uploadTrails(Trails *trails) {
+    TrailQueue *queue = &trails->queue;
+    int queued = atomicFetchAdd(&queue->queued, 0);
+    if (queue->uploaded == queued) {
+        return false;
+    }
+    GLsizeiptr size = 3 * (GLsizeiptr)trails->numTrails * sizeof(float);
+    while (queue->uploaded < queued) {
+        int entry = queue->uploaded % TRAIL_QUEUE;
+        if (queue->launches[entry]) {
+            if (trails->numUploaded > 0) {
+                // The points are rewritten from the start, which the last frames may still be drawing.
+                glFinish();
+            }
+            trails->numUploaded = 0;
+        }
+        appendToBuffer(&trails->buffer, trails->numUploaded * size, queue->points + 3 * (size_t)trails->numTrails * entry, size);
+        trails->numUploaded++;
+        atomicFetchAdd(&queue->uploaded, 1);
+    }
+    return true;
+}
+
+static bool trailsQueued(Trails *trails) {
+    return atomicFetchAdd(&trails->queue.queued, 0) != trails->queue.uploaded;
+}
+
+static void drawTrails(Trails *trails, float viewProjection[16]) {
+    glUseProgram(trails->programId);
+    glUniformMatrix4fv(trails->viewProjectionLocation, 1, GL_FALSE, viewProjection);
+    glUniform1i(trails->numTrailsLocation, trails->numTrails);
+    glUniform1i(trails->numPhotonsLocation, trails->numPhotons);
+    glDrawArraysInstanced(GL_LINE_STRIP, 0, trails->numUploaded, trails->numTrails);
+}